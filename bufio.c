@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "bufio.h"
 
@@ -513,7 +514,7 @@ static int lua_discardk(lua_State *L, int status, lua_KContext ctx)
         n = blen;
 
     buffer_skip(b, n);
-    b->n -= blen;
+    b->n -= n;
 
     if (!b->n) {
         lua_pushboolean(L, true);
@@ -542,6 +543,231 @@ static int lua_bufio_discard(lua_State *L)
     return lua_discardk(L, 0, (lua_KContext)b);
 }
 
+enum {
+    CHUNKED_SIZE,
+    CHUNKED_DATA,
+    CHUNKED_DATA_END,
+    CHUNKED_TRAILER
+};
+
+static int chunked_parse_size(const char *line, size_t len, size_t *size)
+{
+    size_t n = 0;
+    int digits = 0;
+
+    for (; len > 0; line++, len--) {
+        char c = *line;
+        int v;
+
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            break;
+
+        if (++digits > sizeof(size_t) * 2 - 1)
+            return -1;
+
+        n = (n << 4) | v;
+    }
+
+    if (!digits)
+        return -1;
+
+    /* chunk extensions are ignored */
+    if (len > 0 && *line != ';' && *line != ' ' && *line != '\t' && *line != '\r')
+        return -1;
+
+    *size = n;
+
+    return 0;
+}
+
+static bool chunked_empty_line(const char *line, size_t len)
+{
+    return len == 0 || (len == 1 && *line == '\r');
+}
+
+static void chunked_push_trailers(lua_State *L, const char *data, const char *end)
+{
+    lua_newtable(L);
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *colon = memchr(data, ':', eol - data);
+        const char *value, *vend = eol;
+        luaL_Buffer name;
+
+        if (colon) {
+            luaL_buffinit(L, &name);
+
+            for (; data < colon; data++)
+                luaL_addchar(&name, tolower(*data));
+
+            luaL_pushresult(&name);
+
+            for (value = colon + 1; value < vend && (*value == ' ' || *value == '\t'); value++);
+            while (vend > value && (vend[-1] == '\r' || vend[-1] == ' ' || vend[-1] == '\t'))
+                vend--;
+
+            lua_pushlstring(L, value, vend - value);
+            lua_rawset(L, -3);
+        }
+
+        data = eol + 1;
+    }
+}
+
+static int lua_readchunkedk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_bufio *b = (struct eco_bufio *)ctx;
+    char *data = buffer_data(b);
+    char *end = data + buffer_length(b);
+    const char *trailer = NULL;
+    const char *trailer_end = NULL;
+    char *dst = data;
+    char *src = data;
+    const char *err;
+
+    b->L = NULL;
+
+    if (eco_bufio_check_overtime(b, L))
+        return 2;
+
+    while (src < end) {
+        const char *eol;
+        size_t n;
+
+        if (b->chunked.state == CHUNKED_DATA) {
+            n = end - src;
+            if (n > b->chunked.remain)
+                n = b->chunked.remain;
+
+            if (dst != src)
+                memmove(dst, src, n);
+
+            dst += n;
+            src += n;
+
+            b->chunked.remain -= n;
+            if (!b->chunked.remain)
+                b->chunked.state = CHUNKED_DATA_END;
+            continue;
+        }
+
+        if (b->chunked.state == CHUNKED_TRAILER) {
+            const char *p = src;
+
+            /* only consume the trailer part when it's complete */
+            while ((eol = memchr(p, '\n', end - p))) {
+                if (chunked_empty_line(p, eol - p))
+                    break;
+                p = eol + 1;
+            }
+
+            if (!eol)
+                break;
+
+            trailer = src;
+            trailer_end = p;
+            src = (char *)eol + 1;
+            break;
+        }
+
+        eol = memchr(src, '\n', end - src);
+        if (!eol)
+            break;
+
+        if (b->chunked.state == CHUNKED_SIZE) {
+            if (chunked_parse_size(src, eol - src, &n)) {
+                err = "invalid chunk size";
+                goto err;
+            }
+
+            if (n == 0) {
+                b->chunked.state = CHUNKED_TRAILER;
+            } else {
+                b->chunked.total += n;
+
+                if (b->chunked.limit && b->chunked.total > b->chunked.limit) {
+                    err = "body too large";
+                    goto err;
+                }
+
+                b->chunked.remain = n;
+                b->chunked.state = CHUNKED_DATA;
+            }
+        } else {
+            if (!chunked_empty_line(src, eol - src)) {
+                err = "invalid chunk data";
+                goto err;
+            }
+
+            b->chunked.state = CHUNKED_SIZE;
+        }
+
+        src = (char *)eol + 1;
+    }
+
+    if (trailer) {
+        lua_pushlstring(L, data, dst - data);
+        lua_pushboolean(L, true);
+        chunked_push_trailers(L, trailer, trailer_end);
+        buffer_skip(b, src - data);
+
+        b->chunked.state = CHUNKED_SIZE;
+        b->chunked.total = 0;
+        return 3;
+    }
+
+    if (dst > data) {
+        lua_pushlstring(L, data, dst - data);
+        buffer_skip(b, src - data);
+        return 1;
+    }
+
+    buffer_skip(b, src - data);
+
+    if (b->fill(b, L, ctx, lua_readchunkedk) < 0) {
+        err = b->error;
+        goto err;
+    }
+
+    return lua_readchunkedk(L, 0, ctx);
+
+err:
+    b->chunked.state = CHUNKED_SIZE;
+    b->chunked.total = 0;
+
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/*
+ Reads a body encoded with the HTTP chunked transfer coding.
+ The function should be called repeatedly until the whole body is read.
+ Each call returns as much decoded data as the buffer holds, followed by
+ a boolean `true` and a table of the trailer fields once the last chunk
+ has been read.
+ The optional limit limits the total size of the decoded body.
+*/
+static int lua_bufio_readchunked(lua_State *L)
+{
+    struct eco_bufio *b = read_check(L);
+
+    if (!b)
+        return 2;
+
+    b->timeout = lua_tonumber(L, 2);
+    b->chunked.limit = luaL_optinteger(L, 3, 0);
+
+    return lua_readchunkedk(L, 0, (lua_KContext)b);
+}
+
 static const struct luaL_Reg methods[] =  {
     {"size", lua_bufio_size},
     {"length", lua_bufio_length},
@@ -550,6 +776,7 @@ static const struct luaL_Reg methods[] =  {
     {"readfull", lua_bufio_readfull},
     {"readuntil", lua_bufio_readuntil},
     {"discard", lua_bufio_discard},
+    {"readchunked", lua_bufio_readchunked},
     {NULL, NULL}
 };
 
@@ -26,6 +26,12 @@ struct eco_bufio {
     size_t size;
     size_t r, w;
     int (*fill)(struct eco_bufio *b, lua_State *L, lua_KContext ctx, lua_KFunction k);
+    struct {
+        uint8_t state;
+        size_t remain;  /* bytes left in the current chunk */
+        size_t total;   /* decoded bytes of the current body */
+        size_t limit;
+    } chunked;
     const char *eof_error;
     const char *error;
     const void *ctx;
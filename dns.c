@@ -0,0 +1,858 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "eco.h"
+
+#define DNS_HEADER_SIZE     12
+#define DNS_MAX_NAME        255
+#define DNS_MAX_LABEL       63
+#define DNS_MAX_POINTERS    64
+
+/* a root name and the fixed fields */
+#define DNS_MIN_QUESTION_SIZE   5
+#define DNS_MIN_RR_SIZE         11
+
+#define DNS_TYPE_A          1
+#define DNS_TYPE_NS         2
+#define DNS_TYPE_CNAME      5
+#define DNS_TYPE_SOA        6
+#define DNS_TYPE_PTR        12
+#define DNS_TYPE_MX         15
+#define DNS_TYPE_TXT        16
+#define DNS_TYPE_AAAA       28
+#define DNS_TYPE_SRV        33
+#define DNS_TYPE_SPF        99
+#define DNS_TYPE_OPT        41
+
+#define DNS_OPT_SIZE        11
+
+static inline uint16_t dns_u16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t dns_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+** Decodes the name at *pos into name (at least DNS_MAX_NAME + 1 bytes) and
+** advances *pos past it. Compression pointers must point backwards, which
+** guarantees termination, and the number of them is limited as well.
+*/
+static const char *dns_decode_name(const uint8_t *msg, size_t len, size_t *pos, char *name)
+{
+    bool jumped = false;
+    size_t p = *pos;
+    int pointers = 0;
+    size_t n = 0;
+
+    while (true) {
+        uint8_t c;
+
+        if (p >= len)
+            return "truncated";
+
+        c = msg[p];
+
+        if (c == 0) {
+            if (!jumped)
+                *pos = p + 1;
+            break;
+        }
+
+        if ((c & 0xc0) == 0xc0) {
+            size_t ptr;
+
+            if (p + 1 >= len)
+                return "truncated";
+
+            ptr = ((c & 0x3f) << 8) | msg[p + 1];
+
+            if (ptr >= p || ++pointers > DNS_MAX_POINTERS)
+                return "bad compression pointer";
+
+            if (!jumped)
+                *pos = p + 2;
+
+            jumped = true;
+            p = ptr;
+            continue;
+        }
+
+        if (c & 0xc0)
+            return "bad label type";
+
+        if (p + 1 + c > len)
+            return "truncated";
+
+        if (n + c + (n > 0) > DNS_MAX_NAME)
+            return "name too long";
+
+        if (n > 0)
+            name[n++] = '.';
+
+        memcpy(name + n, msg + p + 1, c);
+        n += c;
+        p += c + 1;
+    }
+
+    name[n] = '\0';
+
+    return NULL;
+}
+
+/* decodes a name in rdata, which must not run over the rdata */
+static const char *dns_decode_rdata_name(lua_State *L, const uint8_t *msg, size_t len,
+    size_t *pos, size_t end, const char *field)
+{
+    char name[DNS_MAX_NAME + 1];
+    const char *err;
+
+    err = dns_decode_name(msg, len, pos, name);
+    if (err)
+        return err;
+
+    if (*pos > end)
+        return "bad record length";
+
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, field);
+
+    return NULL;
+}
+
+static const char *dns_decode_txt(lua_State *L, const uint8_t *msg, size_t pos, size_t end, const char *field)
+{
+    int n = 0;
+
+    lua_newtable(L);
+
+    while (pos < end) {
+        size_t slen = msg[pos++];
+
+        /* truncate the over-run TXT record data */
+        if (pos + slen > end)
+            slen = end - pos;
+
+        lua_pushlstring(L, (const char *)msg + pos, slen);
+        lua_rawseti(L, -2, ++n);
+        pos += slen;
+    }
+
+    /* a single string, or a list of strings */
+    if (n < 2) {
+        lua_rawgeti(L, -1, 1);
+        if (n == 0) {
+            lua_pop(L, 1);
+            lua_pushliteral(L, "");
+        }
+        lua_remove(L, -2);
+    }
+
+    lua_setfield(L, -2, field);
+
+    return NULL;
+}
+
+static const char *dns_decode_record(lua_State *L, const uint8_t *msg, size_t len, size_t *pos, int section)
+{
+    static const char *soa_fields[] = {"serial", "refresh", "retry", "expire", "minimum"};
+    char name[DNS_MAX_NAME + 1];
+    uint16_t type, rdlen;
+    const char *err;
+    size_t p, end;
+
+    err = dns_decode_name(msg, len, pos, name);
+    if (err)
+        return err;
+
+    p = *pos;
+
+    if (p + 10 > len)
+        return "truncated";
+
+    type = dns_u16(msg + p);
+    rdlen = dns_u16(msg + p + 8);
+
+    p += 10;
+    end = p + rdlen;
+
+    if (end > len)
+        return "truncated";
+
+    lua_createtable(L, 0, 8);
+
+    lua_pushinteger(L, section);
+    lua_setfield(L, -2, "section");
+
+    lua_pushinteger(L, type);
+    lua_setfield(L, -2, "type");
+
+    lua_pushinteger(L, dns_u16(msg + *pos + 2));
+    lua_setfield(L, -2, "class");
+
+    lua_pushinteger(L, dns_u32(msg + *pos + 4));
+    lua_setfield(L, -2, "ttl");
+
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "name");
+
+    switch (type) {
+    case DNS_TYPE_A:
+    case DNS_TYPE_AAAA: {
+        char ip[INET6_ADDRSTRLEN];
+
+        if (type == DNS_TYPE_A && rdlen != 4)
+            return "bad A record value length";
+
+        if (type == DNS_TYPE_AAAA && rdlen != 16)
+            return "bad AAAA record value length";
+
+        inet_ntop(type == DNS_TYPE_A ? AF_INET : AF_INET6, msg + p, ip, sizeof(ip));
+
+        lua_pushstring(L, ip);
+        lua_setfield(L, -2, "address");
+        break;
+    }
+
+    case DNS_TYPE_CNAME:
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "cname");
+        break;
+
+    case DNS_TYPE_NS:
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "nsdname");
+        break;
+
+    case DNS_TYPE_PTR:
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "ptrdname");
+        break;
+
+    case DNS_TYPE_MX:
+        if (rdlen < 3)
+            return "bad MX record value length";
+
+        lua_pushinteger(L, dns_u16(msg + p));
+        lua_setfield(L, -2, "preference");
+
+        p += 2;
+
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "exchange");
+        break;
+
+    case DNS_TYPE_SRV:
+        if (rdlen < 7)
+            return "bad SRV record value length";
+
+        lua_pushinteger(L, dns_u16(msg + p));
+        lua_setfield(L, -2, "priority");
+
+        lua_pushinteger(L, dns_u16(msg + p + 2));
+        lua_setfield(L, -2, "weight");
+
+        lua_pushinteger(L, dns_u16(msg + p + 4));
+        lua_setfield(L, -2, "port");
+
+        p += 6;
+
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "target");
+        break;
+
+    case DNS_TYPE_TXT:
+    case DNS_TYPE_SPF:
+        err = dns_decode_txt(L, msg, p, end, type == DNS_TYPE_TXT ? "txt" : "spf");
+        break;
+
+    case DNS_TYPE_SOA: {
+        int i;
+
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "mname");
+        if (err)
+            break;
+
+        err = dns_decode_rdata_name(L, msg, len, &p, end, "rname");
+        if (err)
+            break;
+
+        if (p + 20 > end)
+            return "bad SOA record value length";
+
+        for (i = 0; i < 5; i++) {
+            lua_pushinteger(L, dns_u32(msg + p + i * 4));
+            lua_setfield(L, -2, soa_fields[i]);
+        }
+        break;
+    }
+
+    default:
+        /* for unknown types, just forward the raw value */
+        lua_pushlstring(L, (const char *)msg + p, rdlen);
+        lua_setfield(L, -2, "rdata");
+        break;
+    }
+
+    if (err)
+        return err;
+
+    *pos = end;
+
+    return NULL;
+}
+
+static const char *dns_decode_section(lua_State *L, const uint8_t *msg, size_t len,
+    size_t *pos, int count, int section, const char *field)
+{
+    /* the count is untrusted, it can't exceed the records the rest may hold */
+    size_t hint = (len - *pos) / DNS_MIN_RR_SIZE;
+    const char *err;
+    int i;
+
+    lua_createtable(L, hint < (size_t)count ? hint : count, 0);
+
+    for (i = 0; i < count; i++) {
+        err = dns_decode_record(L, msg, len, pos, section);
+        if (err)
+            return err;
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_setfield(L, -2, field);
+
+    return NULL;
+}
+
+/*
+** Decodes a DNS message into a table, which contains the header fields,
+** 'questions' and the records of sections 'answers', 'authority' and 'additional'.
+** In case of malformed message, it returns nil followed by an error message.
+*/
+static int lua_dns_parse(lua_State *L)
+{
+    size_t len;
+    const uint8_t *msg = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    uint16_t flags, qdcount;
+    const char *err;
+    size_t pos, hint;
+    int i;
+
+    if (len < DNS_HEADER_SIZE) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "truncated");
+        return 2;
+    }
+
+    flags = dns_u16(msg + 2);
+    qdcount = dns_u16(msg + 4);
+
+    lua_createtable(L, 0, 16);
+
+    lua_pushinteger(L, dns_u16(msg));
+    lua_setfield(L, -2, "id");
+
+    lua_pushinteger(L, flags);
+    lua_setfield(L, -2, "flags");
+
+    lua_pushboolean(L, flags & 0x8000);
+    lua_setfield(L, -2, "qr");
+
+    lua_pushinteger(L, (flags >> 11) & 0xf);
+    lua_setfield(L, -2, "opcode");
+
+    lua_pushboolean(L, flags & 0x0400);
+    lua_setfield(L, -2, "aa");
+
+    lua_pushboolean(L, flags & 0x0200);
+    lua_setfield(L, -2, "tc");
+
+    lua_pushboolean(L, flags & 0x0100);
+    lua_setfield(L, -2, "rd");
+
+    lua_pushboolean(L, flags & 0x0080);
+    lua_setfield(L, -2, "ra");
+
+    lua_pushinteger(L, flags & 0xf);
+    lua_setfield(L, -2, "rcode");
+
+    pos = DNS_HEADER_SIZE;
+
+    /* the count is untrusted, it can't exceed the questions the rest may hold */
+    hint = (len - pos) / DNS_MIN_QUESTION_SIZE;
+    lua_createtable(L, hint < qdcount ? hint : qdcount, 0);
+
+    for (i = 0; i < qdcount; i++) {
+        char name[DNS_MAX_NAME + 1];
+
+        err = dns_decode_name(msg, len, &pos, name);
+        if (err)
+            goto err;
+
+        if (pos + 4 > len) {
+            err = "truncated";
+            goto err;
+        }
+
+        lua_createtable(L, 0, 3);
+
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+
+        lua_pushinteger(L, dns_u16(msg + pos));
+        lua_setfield(L, -2, "type");
+
+        lua_pushinteger(L, dns_u16(msg + pos + 2));
+        lua_setfield(L, -2, "class");
+
+        lua_rawseti(L, -2, i + 1);
+
+        pos += 4;
+    }
+
+    lua_setfield(L, -2, "questions");
+
+    err = dns_decode_section(L, msg, len, &pos, dns_u16(msg + 6), 1, "answers");
+    if (err)
+        goto err;
+
+    err = dns_decode_section(L, msg, len, &pos, dns_u16(msg + 8), 2, "authority");
+    if (err)
+        goto err;
+
+    err = dns_decode_section(L, msg, len, &pos, dns_u16(msg + 10), 3, "additional");
+    if (err)
+        goto err;
+
+    return 1;
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/* Encodes the name into buf (at least DNS_MAX_NAME + 1 bytes), returns the length or -1 */
+static int dns_encode_name(const char *name, size_t len, uint8_t *buf)
+{
+    size_t n = 0;
+
+    /* the trailing dot is optional */
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+
+    while (len > 0) {
+        const char *dot = memchr(name, '.', len);
+        size_t llen = dot ? dot - name : len;
+
+        if (llen == 0 || llen > DNS_MAX_LABEL || n + llen + 2 > DNS_MAX_NAME)
+            return -1;
+
+        buf[n++] = llen;
+        memcpy(buf + n, name, llen);
+        n += llen;
+
+        if (!dot)
+            break;
+
+        name += llen + 1;
+        len -= llen + 1;
+    }
+
+    buf[n++] = 0;
+
+    return n;
+}
+
+/*
+** Encodes a query message with one question.
+** Arguments: id, flags, qname, qtype, an optional qclass (defaults to 1),
+** and an optional UDP payload size to advertise in an EDNS0 OPT record (RFC 6891).
+*/
+static int lua_dns_encode_query(lua_State *L)
+{
+    uint16_t id = luaL_checkinteger(L, 1);
+    uint16_t flags = luaL_checkinteger(L, 2);
+    size_t len;
+    const char *qname = luaL_checklstring(L, 3, &len);
+    uint16_t qtype = luaL_checkinteger(L, 4);
+    uint16_t qclass = luaL_optinteger(L, 5, 1);
+    uint16_t udp_size = luaL_optinteger(L, 6, 0);
+    uint8_t buf[DNS_HEADER_SIZE + DNS_MAX_NAME + 1 + 4 + DNS_OPT_SIZE] = {};
+    uint8_t *p = buf + DNS_HEADER_SIZE;
+    int n;
+
+    n = dns_encode_name(qname, len, p);
+    if (n < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad name");
+        return 2;
+    }
+
+    buf[0] = id >> 8;
+    buf[1] = id;
+    buf[2] = flags >> 8;
+    buf[3] = flags;
+    buf[5] = 1; /* qdcount */
+
+    p += n;
+
+    *p++ = qtype >> 8;
+    *p++ = qtype;
+    *p++ = qclass >> 8;
+    *p++ = qclass;
+
+    if (udp_size > 0) {
+        buf[11] = 1; /* arcount */
+
+        /* root name, type, class as the UDP payload size, ttl and rdlen are zero */
+        p[1] = DNS_TYPE_OPT >> 8;
+        p[2] = DNS_TYPE_OPT & 0xff;
+        p[3] = udp_size >> 8;
+        p[4] = udp_size;
+
+        p += DNS_OPT_SIZE;
+    }
+
+    lua_pushlstring(L, (const char *)buf, p - buf);
+
+    return 1;
+}
+
+/* Returns the position past the name at pos, or 0 if it's malformed */
+static size_t dns_skip_name(const uint8_t *msg, size_t len, size_t pos)
+{
+    while (pos < len) {
+        uint8_t c = msg[pos];
+
+        if (c == 0)
+            return pos + 1;
+
+        if ((c & 0xc0) == 0xc0)
+            return pos + 2 <= len ? pos + 2 : 0;
+
+        if (c & 0xc0)
+            return 0;
+
+        pos += c + 1;
+    }
+
+    return 0;
+}
+
+/* Returns the position past the question section, or 0 if it's malformed */
+static size_t dns_skip_questions(const uint8_t *msg, size_t len)
+{
+    size_t pos = DNS_HEADER_SIZE;
+    int n = dns_u16(msg + 4);
+
+    while (n-- > 0) {
+        pos = dns_skip_name(msg, len, pos);
+        if (!pos || pos + 4 > len)
+            return 0;
+        pos += 4;
+    }
+
+    return pos;
+}
+
+/*
+** Parses a query with one question without creating tables. Returns the question
+** name in lower case, the question type and class, the flags and the UDP payload
+** size in the OPT record (0 if there's none).
+*/
+static int lua_dns_parse_query(lua_State *L)
+{
+    size_t len;
+    const uint8_t *msg = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    char name[DNS_MAX_NAME + 1];
+    uint16_t qtype, qclass;
+    int udp_size = 0;
+    const char *err;
+    size_t pos = DNS_HEADER_SIZE;
+    int i, nrr;
+
+    if (len < DNS_HEADER_SIZE) {
+        err = "truncated";
+        goto err;
+    }
+
+    if (dns_u16(msg + 4) != 1) {
+        err = "bad number of questions";
+        goto err;
+    }
+
+    err = dns_decode_name(msg, len, &pos, name);
+    if (err)
+        goto err;
+
+    if (pos + 4 > len) {
+        err = "truncated";
+        goto err;
+    }
+
+    qtype = dns_u16(msg + pos);
+    qclass = dns_u16(msg + pos + 2);
+
+    pos += 4;
+
+    nrr = dns_u16(msg + 6) + dns_u16(msg + 8) + dns_u16(msg + 10);
+
+    for (i = 0; i < nrr; i++) {
+        pos = dns_skip_name(msg, len, pos);
+        if (!pos || pos + 10 > len) {
+            err = "truncated";
+            goto err;
+        }
+
+        if (dns_u16(msg + pos) == DNS_TYPE_OPT)
+            udp_size = dns_u16(msg + pos + 2);
+
+        pos += 10 + dns_u16(msg + pos + 8);
+    }
+
+    for (i = 0; name[i]; i++)
+        name[i] = tolower(name[i]);
+
+    lua_pushstring(L, name);
+    lua_pushinteger(L, qtype);
+    lua_pushinteger(L, qclass);
+    lua_pushinteger(L, dns_u16(msg + 2));
+    lua_pushinteger(L, udp_size);
+
+    return 5;
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/*
+** Builds a reply to the query from a response message (e.g. a cached one) in one pass:
+** takes the id and the question name (in its original case) from the query, decreases
+** the TTLs by elapsed seconds, removes the OPT record unless keep_opt is true, and if the
+** message is longer than limit, truncates it to the question with the TC bit set.
+** Arguments: msg, query, elapsed, limit (0 for unlimited), keep_opt.
+*/
+static int lua_dns_reply(lua_State *L)
+{
+    size_t mlen, qlen;
+    const uint8_t *msg = (const uint8_t *)luaL_checklstring(L, 1, &mlen);
+    const uint8_t *query = (const uint8_t *)luaL_checklstring(L, 2, &qlen);
+    lua_Integer elapsed = luaL_optinteger(L, 3, 0);
+    size_t limit = luaL_optinteger(L, 4, 0);
+    bool keep_opt = lua_toboolean(L, 5);
+    size_t pos, qend, opt_start = 0, opt_end = 0;
+    int i, nrr;
+    luaL_Buffer b;
+    uint8_t *out;
+
+    if (mlen < DNS_HEADER_SIZE || qlen < DNS_HEADER_SIZE)
+        goto err;
+
+    out = (uint8_t *)luaL_buffinitsize(L, &b, mlen);
+    memcpy(out, msg, mlen);
+
+    out[0] = query[0];
+    out[1] = query[1];
+
+    qend = dns_skip_questions(out, mlen);
+    if (!qend)
+        goto err;
+
+    if (dns_u16(out + 4) == 1 && dns_u16(query + 4) == 1) {
+        size_t qname_end = dns_skip_name(query, qlen, DNS_HEADER_SIZE);
+
+        if (qname_end && qname_end == dns_skip_name(out, mlen, DNS_HEADER_SIZE))
+            memcpy(out + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, qname_end - DNS_HEADER_SIZE);
+    }
+
+    nrr = dns_u16(out + 6) + dns_u16(out + 8) + dns_u16(out + 10);
+    pos = qend;
+
+    for (i = 0; i < nrr; i++) {
+        size_t start = pos;
+
+        pos = dns_skip_name(out, mlen, pos);
+        if (!pos || pos + 10 > mlen)
+            goto err;
+
+        if (dns_u16(out + pos) == DNS_TYPE_OPT) {
+            opt_start = start;
+            opt_end = pos + 10 + dns_u16(out + pos + 8);
+        } else {
+            lua_Integer ttl = dns_u32(out + pos + 4) - elapsed;
+
+            if (ttl < 0)
+                ttl = 0;
+
+            out[pos + 4] = ttl >> 24;
+            out[pos + 5] = ttl >> 16;
+            out[pos + 6] = ttl >> 8;
+            out[pos + 7] = ttl;
+        }
+
+        pos += 10 + dns_u16(out + pos + 8);
+        if (pos > mlen)
+            goto err;
+    }
+
+    if (opt_end && !keep_opt && dns_u16(out + 10) > 0) {
+        memmove(out + opt_start, out + opt_end, mlen - opt_end);
+        mlen -= opt_end - opt_start;
+
+        i = dns_u16(out + 10) - 1;
+        out[10] = i >> 8;
+        out[11] = i;
+    }
+
+    if (limit > 0 && mlen > limit) {
+        mlen = qend;
+        out[2] |= 0x02; /* TC */
+        memset(out + 6, 0, 6);
+    }
+
+    luaL_pushresultsize(&b, mlen);
+
+    return 1;
+
+err:
+    lua_pushnil(L);
+    lua_pushliteral(L, "malformed message");
+    return 2;
+}
+
+/*
+** Builds an error response with the rcode for the query, which carries the question
+** of the query if it's well-formed.
+*/
+static int lua_dns_error_reply(lua_State *L)
+{
+    size_t qlen;
+    const uint8_t *query = (const uint8_t *)luaL_checklstring(L, 1, &qlen);
+    int rcode = luaL_checkinteger(L, 2);
+    uint8_t hdr[DNS_HEADER_SIZE] = {};
+    size_t qend;
+
+    if (qlen < DNS_HEADER_SIZE) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "truncated");
+        return 2;
+    }
+
+    qend = dns_skip_questions(query, qlen);
+
+    hdr[0] = query[0];
+    hdr[1] = query[1];
+    hdr[2] = 0x80 | (query[2] & 0x79); /* QR, opcode and RD */
+    hdr[3] = 0x80 | (rcode & 0xf);     /* RA */
+
+    if (qend) {
+        hdr[4] = query[4];
+        hdr[5] = query[5];
+    } else {
+        qend = DNS_HEADER_SIZE;
+    }
+
+    lua_pushlstring(L, (const char *)hdr, DNS_HEADER_SIZE);
+    lua_pushlstring(L, (const char *)query + DNS_HEADER_SIZE, qend - DNS_HEADER_SIZE);
+    lua_concat(L, 2);
+
+    return 1;
+}
+
+/* Fills buf from the kernel CSPRNG, falls back to /dev/urandom if getrandom(2) is missing */
+static int dns_getrandom(void *buf, size_t len)
+{
+    size_t n = 0;
+    ssize_t ret;
+    int fd;
+
+#ifdef SYS_getrandom
+    do {
+        ret = syscall(SYS_getrandom, buf, len, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret == (ssize_t)len)
+        return 0;
+#endif
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    while (n < len) {
+        ret = read(fd, (uint8_t *)buf + n, len - n);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            if (ret == 0)
+                errno = EIO;
+            close(fd);
+            return -1;
+        }
+
+        n += ret;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+/*
+** Returns an unpredictable integer uniformly distributed in [m, n], for the query
+** ids and source ports, which must not be guessed by an off-path attacker.
+** n - m must be less than 2^32.
+*/
+static int lua_dns_random(lua_State *L)
+{
+    lua_Integer m = luaL_checkinteger(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    uint64_t span = (uint64_t)n - (uint64_t)m + 1;
+    uint32_t threshold, r;
+
+    luaL_argcheck(L, m <= n && span <= 0x100000000ULL, 2, "invalid range");
+
+    /* rejects the values below 2^32 % span, which would bias the modulo */
+    threshold = (0x100000000ULL % span);
+
+    do {
+        if (dns_getrandom(&r, sizeof(r))) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    } while (r < threshold);
+
+    lua_pushinteger(L, m + r % span);
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"parse", lua_dns_parse},
+    {"encode_query", lua_dns_encode_query},
+    {"parse_query", lua_dns_parse_query},
+    {"reply", lua_dns_reply},
+    {"error_reply", lua_dns_error_reply},
+    {"random", lua_dns_random},
+    {NULL, NULL}
+};
+
+int luaopen_eco_core_dns(lua_State *L)
+{
+    luaL_newlib(L, funcs);
+
+    return 1;
+}
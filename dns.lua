@@ -4,7 +4,10 @@
 -- Referenced from https://github.com/openresty/lua-resty-dns/blob/master/lib/resty/dns/resolver.lua
 
 local file = require 'eco.core.file'
+local dnsc = require 'eco.core.dns'
 local socket = require 'eco.socket'
+local time = require 'eco.time'
+local sync = require 'eco.sync'
 
 local M = {
     TYPE_A      = 1,
@@ -31,15 +34,54 @@ local resolver_errstrs = {
     'refused',          -- 5
 }
 
-local soa_int32_fields = { 'serial', 'refresh', 'retry', 'expire', 'minimum' }
+-- the parsed resolv.conf and hosts, reloaded when the file changes
+local resolvconf_cache = {}
+local hosts_cache = {}
 
-local transaction_id_init
+-- the queries in flight, keyed by the same key as cache
+local inflight = {}
+
+local cache = {
+    size = 512,
+    negative_ttl = 30,
+    max_ttl = 86400,
+    count = 0,
+    entries = {},
+    lru = {}
+}
+
+cache.lru.prev = cache.lru
+cache.lru.next = cache.lru
+
+local function file_changed(path, cached)
+    local st = file.stat(path)
+    if not st then
+        st = { mtime = -1, size = -1 }
+    end
+
+    if st.mtime == cached.mtime and st.size == cached.size then
+        return false
+    end
+
+    cached.mtime = st.mtime
+    cached.size = st.size
+
+    return true, st.mtime ~= -1
+end
 
 local function parse_resolvconf()
+    local changed, exist = file_changed('/etc/resolv.conf', resolvconf_cache)
+
+    if not changed then
+        return resolvconf_cache.conf
+    end
+
     local nameservers = {}
     local conf = {}
 
-    if not file.access('/etc/resolv.conf') then
+    resolvconf_cache.conf = conf
+
+    if not exist then
         conf.nameservers = {{ '127.0.0.1', 53 }}
         return conf
     end
@@ -69,387 +111,661 @@ local function parse_resolvconf()
     return conf
 end
 
-local function get_next_transaction_id()
-    if not transaction_id_init then
-        transaction_id_init = math.random(0, 65535)
-    else
-        transaction_id_init = transaction_id_init % 65535 + 1
+local function parse_hosts()
+    local changed, exist = file_changed('/etc/hosts', hosts_cache)
+
+    if not changed then
+        return hosts_cache.hosts
     end
 
-    return transaction_id_init
-end
+    local hosts = {}
 
-local function build_request(qname, id, opts)
-    local flags = 0
+    hosts_cache.hosts = hosts
 
-    if not opts.no_recurse then
-        flags = flags | 1 << 8
+    if not exist then
+        return hosts
     end
 
-    local nqs = 1
-    local nan = 0
-    local nns = 0
-    local nar = 0
+    for line in io.lines('/etc/hosts') do
+        line = line:gsub('#.*', '')
 
-    local name = qname:gsub('([^.]+)%.?', function(s)
-        return string.char(#s) .. s
-    end)
+        local address, names = line:match('^%s*(%S+)%s+(.+)')
+        if address then
+            local typ
+
+            if socket.is_ipv4_address(address) then
+                typ = M.TYPE_A
+            elseif socket.is_ipv6_address(address) then
+                typ = M.TYPE_AAAA
+            end
+
+            if typ then
+                for name in names:gmatch('%S+') do
+                    name = name:lower()
+                    hosts[name] = hosts[name] or {}
+                    table.insert(hosts[name], { type = typ, address = address })
+                end
+            end
+        end
+    end
 
-    return string.pack('>I2I2I2I2I2I2zI2I2',
-        id, flags, nqs, nan, nns, nar, name, opts.type or M.TYPE_A, M.CLASS_IN)
+    return hosts
 end
 
-local function decode_name(buf, pos)
-    local labels = {}
-    local nptrs = 0
-    local p = pos
+local function query_hosts(qname, typ)
+    local records = parse_hosts()[qname:lower()]
+    if not records then
+        return nil
+    end
 
-    while nptrs < 128 do
-        local fst = string.byte(buf, p)
+    local answers = {}
 
-        if not fst then
-            return nil, 'truncated';
+    for _, r in ipairs(records) do
+        if r.type == typ then
+            answers[#answers + 1] = {
+                section = M.SECTION_AN,
+                type = typ,
+                class = M.CLASS_IN,
+                ttl = 0,
+                name = qname,
+                address = r.address
+            }
         end
+    end
 
-        if fst == 0 then
-            if nptrs == 0 then
-                pos = pos + 1
-            end
-            break
+    if #answers > 0 then
+        return answers
+    end
+end
+
+-- copy answers, so the shared answers can't be modified by the caller
+local function copy_answers(answers, ttl)
+    local copied = {}
+
+    for i, a in ipairs(answers) do
+        local ans = {}
+
+        for k, v in pairs(a) do
+            ans[k] = v
         end
 
-        if fst & 0xc0 ~= 0 then
-            -- being a pointer
-            if nptrs == 0 then
-                pos = pos + 2
-            end
+        if ttl then
+            ans.ttl = math.min(ans.ttl, ttl)
+        end
 
-            nptrs = nptrs + 1
+        copied[i] = ans
+    end
 
-            local snd = string.byte(buf, p + 1)
-            if not snd then
-                return nil, 'truncated'
-            end
+    return copied
+end
 
-            p = ((fst & 0x3f) << 8) + snd + 1
-        else
-            -- being a label
-            local label = buf:sub(p + 1, p + fst)
-            labels[#labels + 1] = label
+local function cache_unlink(e)
+    e.prev.next = e.next
+    e.next.prev = e.prev
+end
 
-            p = p + fst + 1
+local function cache_push_front(e)
+    local lru = cache.lru
 
-            if nptrs == 0 then
-                pos = p
-            end
-        end
+    e.next = lru.next
+    e.prev = lru
+    lru.next.prev = e
+    lru.next = e
+end
+
+local function cache_remove(e)
+    cache_unlink(e)
+    cache.entries[e.key] = nil
+    cache.count = cache.count - 1
+end
+
+local function cache_get(key)
+    local e = cache.entries[key]
+    if not e then
+        return nil
+    end
+
+    local now = time.now()
+
+    if e.expires <= now then
+        cache_remove(e)
+        return nil
+    end
+
+    cache_unlink(e)
+    cache_push_front(e)
+
+    if not e.answers then
+        return nil, e.err
     end
 
-    return table.concat(labels, '.'), pos
+    return copy_answers(e.answers, math.ceil(e.expires - now))
 end
 
-local function parse_section(answers, section, buf, start_pos, size)
-    local pos = start_pos
+local function cache_set(key, answers, err, ttl)
+    ttl = math.min(ttl, cache.max_ttl)
 
-    for _ = 1, size do
-        local name
-        name, pos = decode_name(buf, pos)
-        if not name then
-            return nil, pos
-        end
+    if cache.size < 1 or ttl < 1 then
+        return
+    end
 
-        local typ, class, ttl, len = string.unpack('>I2I2I4I2', buf:sub(pos))
+    local e = cache.entries[key]
+    if e then
+        cache_remove(e)
+    end
 
-        local ans = {
-            section = section,
-            type = typ,
-            class = class,
-            ttl = ttl,
-            name = name
-        }
+    -- evict the least recently used
+    while cache.count >= cache.size do
+        cache_remove(cache.lru.prev)
+    end
 
-        answers[#answers + 1] = ans
+    e = { key = key, answers = answers, err = err, expires = time.now() + ttl }
 
-        pos = pos + 10
+    cache.entries[key] = e
+    cache.count = cache.count + 1
 
-        if typ == M.TYPE_A then
+    cache_push_front(e)
+end
 
-            if len ~= 4 then
-                return nil, 'bad A record value length: ' .. len
-            end
+local function cache_key(qname, opts, resolver)
+    local key = { qname:lower(), opts.type or M.TYPE_A, opts.no_recurse and 1 or 0, resolver.mark or '', resolver.device or '' }
 
-            local addr_bytes = { string.byte(buf, pos, pos + 3) }
-            local addr = table.concat(addr_bytes, '.')
+    if resolver.custom then
+        for _, ch in ipairs(resolver.channels) do
+            key[#key + 1] = ch.nameserver[1] .. '#' .. ch.nameserver[2]
+        end
+    end
 
-            ans.address = addr
+    return table.concat(key, ' ')
+end
 
-            pos = pos + 4
+local function build_request(qname, id, opts, udp_size)
+    local flags = 0
 
-        elseif typ == M.TYPE_CNAME then
+    if not opts.no_recurse then
+        flags = flags | 1 << 8
+    end
 
-            local cname, p = decode_name(buf, pos)
-            if not cname then
-                return nil, pos
-            end
+    return dnsc.encode_query(id, flags, qname, opts.type or M.TYPE_A, M.CLASS_IN, udp_size)
+end
 
-            if p - pos ~= len then
-                return nil, string.format('bad cname record length: %d ~= %d', p - pos, len)
-            end
+local function parse_response(buf, id, qname, qtype)
+    local msg, err = dnsc.parse(buf)
+    if not msg then
+        return nil, err
+    end
 
-            pos = p
+    if msg.id ~= id then
+        return nil, 'id mismatch'
+    end
 
-            ans.cname = cname
+    if not msg.qr then
+        return nil, 'bad QR flag in the DNS response'
+    end
 
-        elseif typ == M.TYPE_AAAA then
+    if #msg.questions ~= 1 then
+        return nil, string.format('bad number of questions in DNS response: %d', #msg.questions)
+    end
 
-            if len ~= 16 then
-                return nil, 'bad AAAA record value length: ' .. len
-            end
+    local question = msg.questions[1]
 
-            local addr_bytes = { string.byte(buf, pos, pos + 15) }
-            local flds = {}
-            for i = 1, 16, 2 do
-                local a = addr_bytes[i]
-                local b = addr_bytes[i + 1]
-                if a == 0 then
-                    flds[#flds + 1] = string.format('%x', b)
-                else
-                    flds[#flds + 1] = string.format('%x%02x', a, b)
-                end
-            end
+    if question.class ~= M.CLASS_IN then
+        return nil, string.format('unknown query class %d in DNS response', question.class)
+    end
+
+    if question.type ~= qtype or question.name:lower() ~= qname:lower() then
+        return nil, 'question mismatch'
+    end
 
-            -- we do not compress the IPv6 addresses by default
-            --  due to performance considerations
+    if msg.tc then
+        return nil, 'truncated', nil, true
+    end
 
-            ans.address = table.concat(flds, ':')
+    local code = msg.rcode
 
-            pos = pos + 16
+    if code ~= 0 and code ~= 3 then
+        return nil, resolver_errstrs[code] or 'unknown'
+    end
 
-        elseif typ == M.TYPE_MX then
+    -- the negative caching ttl comes from the SOA record in authority section (RFC 2308)
+    local negative_ttl
 
-            if len < 3 then
-                return nil, 'bad MX record value length: ' .. len
+    if code == 3 or #msg.answers == 0 then
+        for _, ans in ipairs(msg.authority) do
+            if ans.type == M.TYPE_SOA then
+                negative_ttl = math.min(ans.ttl, ans.minimum)
+                break
             end
+        end
+    end
 
-            ans.preference = string.unpack('>I2', buf:sub(pos))
+    if code == 3 then
+        return nil, resolver_errstrs[code], negative_ttl
+    end
 
-            local host, p = decode_name(buf, pos + 2)
-            if not host then
-                return nil, pos
-            end
+    return msg.answers, nil, negative_ttl
+end
 
-            if p - pos ~= len then
-                return nil, string.format('bad cname record length: %d ~= %d', p - pos, len)
-            end
+local function parse_nameservers(list)
+    local nameservers = {}
 
-            ans.exchange = host
+    for _, nameserver in ipairs(list) do
+        local host, port
 
-            pos = p
+        if type(nameserver) == 'string' then
+            host = nameserver
+            port = 53
+        elseif type(nameserver) == 'table' then
+            host = nameserver[1]
+            port = nameserver[2] or 53
+        else
+            error('invalid nameservers')
+        end
 
-        elseif typ == M.TYPE_SRV then
-            if len < 7 then
-                return nil, 'bad SRV record value length: ' .. len
-            end
+        if not socket.is_ip_address(host) then
+            error('invalid nameserver: ' .. host)
+        end
 
-            ans.priority, ans.weight, ans.port = string.unpack('>I2I2I2', buf:sub(pos))
+        nameservers[#nameservers + 1] = { host, port, socket.is_ipv6_address(host) }
+    end
 
-            local name, p = decode_name(buf, pos + 6)
-            if not name then
-                return nil, pos
-            end
+    return nameservers
+end
 
-            if p - pos ~= len then
-                return nil, string.format('bad srv record length: %d ~= %d', p - pos, len)
-            end
+local function query_deliver(w, answers, err, negative_ttl, data)
+    if w.done then
+        return
+    end
 
-            ans.target = name
+    if answers or err == 'name error' then
+        w.done = true
+        w.answers, w.err, w.negative_ttl, w.data = answers, err, negative_ttl, data
+    else
+        w.failed = w.failed + 1
+        w.err = err
+    end
 
-            pos = p
+    w.cond:broadcast()
+end
 
-        elseif typ == M.TYPE_NS then
-            local name, p = decode_name(buf, pos)
-            if not name then
-                return nil, pos
-            end
+local function channel_fail(ch, pending, err)
+    err = string.format('"%s:%d": %s', ch.nameserver[1], ch.nameserver[2], err)
 
-            if p - pos ~= len then
-                return nil, string.format('bad cname record length: %d ~= %d', p - pos, len)
-            end
+    for id, w in pairs(pending) do
+        pending[id] = nil
+        query_deliver(w, nil, err)
+    end
+end
 
-            pos = p
+-- the ids and source ports come from the kernel CSPRNG, so they can't be guessed by spoofers
+local function channel_alloc_id(pending)
+    for _ = 1, 100 do
+        local id, err = dnsc.random(0, 65535)
+        if not id then
+            return nil, err
+        end
 
-            ans.nsdname = name
+        if not pending[id] then
+            return id
+        end
+    end
 
-        elseif typ == M.TYPE_TXT or typ == M.TYPE_SPF then
-            local key = typ == M.TYPE_TXT and 'txt' or 'spf'
+    return nil, 'too many queries in flight'
+end
 
-            local slen = string.byte(buf, pos)
-            if slen + 1 > len then
-                -- truncate the over-run TXT record data
-                slen = len
-            end
+local CHANNEL_IDLE_TIMEOUT = 10.0
 
-            local val = buf:sub(pos + 1, pos + slen)
-            local last = pos + len
-            pos = pos + slen + 1
-
-            if pos < last then
-                -- more strings to be processed
-                -- this code path is usually cold, so we do not
-                -- merge the following loop on this code path
-                -- with the processing logic above.
-
-                val = {val}
-                local idx = 2
-                repeat
-                    slen = string.byte(buf, pos)
-                    if pos + slen + 1 > last then
-                        -- truncate the over-run TXT record data
-                        slen = last - pos - 1
-                    end
-
-                    val[idx] = buf:sub(pos + 1, pos + slen)
-                    idx = idx + 1
-                    pos = pos + slen + 1
-
-                until pos >= last
-            end
+local channel_dispatch
 
-            ans[key] = val
+--[[
+    Opens a TCP connection to the nameserver, which is shared by the queries
+    whose UDP response is truncated. A coroutine reads the length-prefixed
+    responses, and closes the connection after it's idle for a while.
+--]]
+local function channel_tcp_open(ch)
+    local resolver = ch.resolver
+    local nameserver = ch.nameserver
+
+    local s, err = socket.connect_tcp(nameserver[1], nameserver[2], {
+        ipv6 = nameserver[3],
+        mark = resolver.mark,
+        device = resolver.device
+    })
+    if not s then
+        return nil, string.format('connect "%s:%d" fail: %s', nameserver[1], nameserver[2], err)
+    end
 
-        elseif typ == M.TYPE_PTR then
-            local name, p = decode_name(buf, pos)
-            if not name then
-                return nil, pos
-            end
+    ch.tcp = s
 
-            if p - pos ~= len then
-                return nil, string.format('bad cname record length: %d ~= %d', p - pos, len)
+    eco.run(function()
+        local pending = ch.tcp_pending
+
+        while true do
+            local data, err = s:recvfull(2, CHANNEL_IDLE_TIMEOUT)
+            if data then
+                data, err = s:recvfull(string.unpack('>I2', data), 5.0)
+                if data then
+                    channel_dispatch(ch, pending, data, true)
+                else
+                    channel_fail(ch, pending, err)
+                    break
+                end
+            elseif err ~= 'timeout' then
+                channel_fail(ch, pending, err)
+                break
+            elseif not next(pending) then
+                break
             end
+        end
 
-            pos = p
+        s:close()
+        ch.tcp = nil
+    end)
 
-            ans.ptrdname = name
+    return s
+end
 
-        elseif typ == M.TYPE_SOA then
-            local name, p = decode_name(buf, pos)
-            if not name then
-                return nil, pos
+local function channel_tcp_send(ch, w, opts)
+    if not ch.tcp then
+        -- share the connection being established
+        if ch.tcp_connecting then
+            ch.tcp_connecting:wait(6.0)
+            if not ch.tcp then
+                return nil, ch.tcp_err or 'timeout'
             end
-            ans.mname = name
+        else
+            ch.tcp_connecting = sync.cond()
 
-            pos = p
-            name, p = decode_name(buf, pos)
-            if not name then
-                return nil, pos
-            end
-            ans.rname = name
+            local ok, err = channel_tcp_open(ch)
+
+            ch.tcp_err = err
+            ch.tcp_connecting:broadcast()
+            ch.tcp_connecting = nil
 
-            for _, field in ipairs(soa_int32_fields) do
-                ans[field] = string.unpack('>I4', buf:sub(p))
-                p = p + 4
+            if not ok then
+                return nil, err
             end
+        end
+    end
 
-            pos = p
+    local pending = ch.tcp_pending
 
-        else
-            -- for unknown types, just forward the raw value
-            ans.rdata = buf:sub(pos, pos + len - 1)
-            pos = pos + len
-        end
+    local id, err = channel_alloc_id(pending)
+    if not id then
+        return nil, err
     end
 
-    return pos
+    local req, err = build_request(w.qname, id, opts)
+    if not req then
+        return nil, err
+    end
+
+    pending[id] = w
+
+    local n, err = ch.tcp:send(string.pack('>s2', req))
+    if not n then
+        pending[id] = nil
+        return nil, string.format('send to "%s:%d" fail: %s', ch.nameserver[1], ch.nameserver[2], err)
+    end
+
+    return id
 end
 
-local function parse_response(buf, id)
-    local n = #buf
-    if n < 12 then
-        return nil, 'truncated';
+function channel_dispatch(ch, pending, data, tcp)
+    if #data < 12 then
+        return
     end
 
-    -- header layout: ident flags nqs nan nns nar
-    local ans_id, flags, nqs, nan = string.unpack('>I2I2I2I2', buf)
+    local id = string.unpack('>I2', data)
 
-    if ans_id ~= id then
-        return nil, 'id mismatch'
+    local w = pending[id]
+    if not w then
+        return
     end
 
-    if flags & 0x8000 == 0 then
-        return nil, 'bad QR flag in the DNS response'
+    local answers, err, negative_ttl, truncated = parse_response(data, id, w.qname, w.qtype)
+
+    -- ignore the forged responses
+    if err == 'question mismatch' then
+        return
     end
 
-    if flags & 0x200 ~= 0 then
-        return nil, 'truncated'
+    pending[id] = nil
+
+    -- retry over TCP
+    if truncated and not tcp then
+        eco.run(function()
+            local id, err = channel_tcp_send(ch, w, w.opts)
+            if not id then
+                query_deliver(w, nil, err)
+            elseif w.finished then
+                ch.tcp_pending[id] = nil
+            else
+                w.registered[#w.registered + 1] = { ch.tcp_pending, id }
+            end
+        end)
+        return
     end
 
-    local code = flags & 0xf
+    -- some old servers don't support EDNS
+    if err == 'format error' and not tcp then
+        ch.no_edns = true
+    end
 
-    if nqs ~= 1 then
-        return nil, string.format('bad number of questions in DNS response: %d', nqs)
+    if not answers and err ~= 'name error' then
+        err = string.format('"%s:%d": %s', ch.nameserver[1], ch.nameserver[2], err)
     end
 
-    -- skip the question part
-    local ans_qname, pos = decode_name(buf, 13)
-    if not ans_qname then
-        return nil, pos
+    query_deliver(w, answers, err, negative_ttl, data)
+end
+
+--[[
+    Opens a connected UDP socket to the nameserver, with a random source port.
+    A coroutine reads the responses and dispatches them to the queries waiting,
+    and closes the socket after it's idle for a while.
+--]]
+local function channel_open(ch)
+    local resolver = ch.resolver
+    local nameserver = ch.nameserver
+    local s, err
+
+    if nameserver[3] then
+        s, err = socket.udp6()
+    else
+        s, err = socket.udp()
+    end
+    if not s then
+        return nil, err
     end
 
-    if pos + 3 + nan * 12 > n then
-        return nil, 'truncated';
+    if resolver.mark then
+        s:setoption('mark', resolver.mark)
     end
 
-    local qclass = string.unpack('>I2', buf:sub(pos + 2))
-    if qclass ~= 1 then
-        return nil, string.format('unknown query class %d in DNS response', qclass)
+    if resolver.device then
+        s:setoption('bindtodevice', resolver.device)
     end
 
-    pos = pos + 4
+    for _ = 1, 10 do
+        local port, err = dnsc.random(1024, 65535)
+        if not port then
+            s:close()
+            return nil, err
+        end
 
-    local answers = {}
+        if s:bind(nil, port) then
+            break
+        end
+    end
 
-    if code ~= 0 then
-        return nil, resolver_errstrs[code] or 'unknown'
+    local ok, err = s:connect(nameserver[1], nameserver[2])
+    if not ok then
+        s:close()
+        return nil, err
     end
 
-    local err
+    ch.sock = s
+
+    eco.run(function()
+        local pending = ch.pending
+        local size = math.max(resolver.edns, 512)
+
+        while true do
+            local data, err = s:recv(size, CHANNEL_IDLE_TIMEOUT)
+            if data then
+                channel_dispatch(ch, pending, data)
+            elseif err ~= 'timeout' then
+                -- e.g. the ICMP port unreachable
+                channel_fail(ch, pending, 'recv fail: ' .. err)
+                break
+            elseif not next(pending) then
+                break
+            end
+        end
+
+        s:close()
+        ch.sock = nil
+    end)
+
+    return s
+end
 
-    pos, err = parse_section(answers, M.SECTION_AN, buf, pos, nan)
+local function channel_send(ch, w, opts)
+    if not ch.sock then
+        local ok, err = channel_open(ch)
+        if not ok then
+            return nil, err
+        end
+    end
 
-    if not pos then
+    local id, err = channel_alloc_id(ch.pending)
+    if not id then
         return nil, err
     end
 
-    return answers
-end
+    local udp_size = not ch.no_edns and ch.resolver.edns or nil
 
-local function query(s, id, req, nameserver)
-    local host, port = nameserver[1], nameserver[2]
-    local n, err = s:sendto(req, host, port)
+    local req, err = build_request(w.qname, id, opts, udp_size)
+    if not req then
+        return nil, err
+    end
+
+    local n, err = ch.sock:send(req)
     if not n then
-        return nil, string.format('sendto "%s:%d" fail: %s', host, port, err)
+        return nil, string.format('send to "%s:%d" fail: %s', ch.nameserver[1], ch.nameserver[2], err)
     end
 
-    local data, err = s:recv(512, 5.0)
-    if not data then
-        return nil, string.format('recv from "%s:%d" fail: %s', host, port, err)
+    ch.pending[id] = w
+
+    return id
+end
+
+--[[
+    Sends the query to the nameservers in turn every 'stagger' seconds, without
+    waiting for the previous one to time out, and the first answer wins.
+    The retries are spread evenly over the timeout. A nameserver which responds
+    with an error makes the next one be queried immediately.
+--]]
+local function resolver_lookup(self, qname, opts)
+    local channels = self.channels
+    local stagger = opts.stagger or self.stagger
+    local retries = opts.retries or self.retries
+    local timeout = opts.timeout or self.timeout
+    local attempts = #channels * (retries + 1)
+    local start = time.now()
+    local deadline = start + timeout
+    local sent, next_time = 0, 0
+    local registered = {}
+
+    local w = {
+        qname = qname,
+        qtype = opts.type or M.TYPE_A,
+        opts = opts,
+        cond = sync.cond(),
+        registered = registered,
+        failed = 0
+    }
+
+    while not w.done do
+        local now = time.now()
+
+        if now >= deadline then
+            break
+        end
+
+        if sent < attempts and (now >= next_time or w.failed == sent) then
+            sent = sent + 1
+
+            local ch = channels[(sent - 1) % #channels + 1]
+
+            local id, err = channel_send(ch, w, opts)
+            if id then
+                registered[#registered + 1] = { ch.pending, id }
+            else
+                w.failed = w.failed + 1
+                w.err = err
+            end
+
+            next_time = start + (sent // #channels) * timeout / (retries + 1) + (sent % #channels) * stagger
+        elseif w.failed == attempts then
+            break
+        else
+            local wait = deadline - now
+
+            if sent < attempts then
+                wait = math.min(wait, next_time - now)
+            end
+
+            w.cond:wait(math.max(wait, 0.001))
+        end
     end
 
-    return parse_response(data, id)
+    w.finished = true
+
+    for _, r in ipairs(registered) do
+        local pending, id = r[1], r[2]
+
+        if pending[id] == w then
+            pending[id] = nil
+        end
+    end
+
+    if w.done then
+        return w.answers, w.err, w.negative_ttl, w.data
+    end
+
+    return nil, w.err or 'timeout'
+end
+
+-- the time to cache the answers, or the negative answer
+local function answers_ttl(answers, negative_ttl)
+    if not answers or #answers == 0 then
+        return negative_ttl or cache.negative_ttl
+    end
+
+    local ttl = math.huge
+
+    for _, ans in ipairs(answers) do
+        ttl = math.min(ttl, ans.ttl)
+    end
+
+    return ttl
 end
 
+local resolver_methods = {}
+
 --[[
     opts is an optional Table that supports the following fields:
     type: The current resource record type, possible values are 1 (TYPE_A), 5 (TYPE_CNAME),
             28 (TYPE_AAAA), and any other values allowed by RFC 1035.
     no_recurse: a boolean flag controls whether to disable the "recursion desired" (RD) flag
                 in the UDP request. Defaults to false
-    nameservers: a list of nameservers to be used. Each nameserver entry can be either a
-                single hostname string or a table holding both the hostname string and the port number.
-    mark: a number used to set SO_MARK to socket
-    device: a string used to set SO_BINDTODEVICE to socket
+    no_cache: a boolean flag controls whether to bypass the query cache. Answers are cached
+                until their ttl expires, nonexistent names are cached too (see set_cache).
+    no_hosts: a boolean flag controls whether to skip /etc/hosts for TYPE_A and TYPE_AAAA.
+    timeout, stagger, retries: override the options of the resolver.
 --]]
-function M.query(qname, opts)
+function resolver_methods:query(qname, opts)
     if string.byte(qname, 1) == string.byte('.') or #qname > 255 then
         return nil, 'bad name'
     end
@@ -470,80 +786,242 @@ function M.query(qname, opts)
 
     opts = opts or {}
 
-    local nameservers = {}
+    local typ = opts.type or M.TYPE_A
 
-    for _, nameserver in ipairs(opts.nameservers or {}) do
-        local host, port
+    if not opts.no_hosts and (typ == M.TYPE_A or typ == M.TYPE_AAAA) then
+        local answers = query_hosts(qname, typ)
+        if answers then
+            return answers
+        end
+    end
 
-        if type(nameserver) == 'string' then
-            host = nameserver
-            port = 53
-        elseif type(nameserver) == 'table' then
-            host = nameserver[1]
-            port = nameserver[2] or 53
-        else
-            error('invalid nameservers')
+    local resolvconf = parse_resolvconf()
+
+    if not qname:match('%.') and resolvconf.search then
+        qname = qname .. '.' .. resolvconf.search
+    end
+
+    local ikey = cache_key(qname, opts, self)
+    local key = not opts.no_cache and ikey
+
+    if key then
+        local answers, err = cache_get(key)
+        if answers or err then
+            return answers, err
         end
+    end
 
-        if not socket.is_ip_address(host) then
-            error('invalid nameserver: ' .. nameserver)
+    -- coalesce the identical queries in flight
+    local pending = inflight[ikey]
+    if pending then
+        if not pending.cond:wait((opts.timeout or self.timeout) + 1.0) then
+            return nil, 'timeout'
         end
 
-        nameservers[#nameservers + 1] = { host, port, socket.is_ipv6_address(host) }
+        if not pending.answers then
+            return nil, pending.err
+        end
+
+        return cache_get(key) or copy_answers(pending.answers)
     end
 
-    local resolvconf = parse_resolvconf()
+    pending = { cond = sync.cond() }
+    inflight[ikey] = pending
 
-    if #nameservers == 0 then
-        for _, nameserver in ipairs(resolvconf.nameservers) do
-            nameservers[#nameservers + 1] = nameserver
+    local answers, err, negative_ttl = resolver_lookup(self, qname, opts)
+
+    inflight[ikey] = nil
+
+    pending.answers, pending.err = answers, err
+    pending.cond:broadcast()
+
+    if answers then
+        if key then
+            cache_set(key, answers, nil, answers_ttl(answers, negative_ttl))
         end
+
+        return cache_get(key) or copy_answers(answers)
     end
 
-    if #nameservers < 1 then
-        return nil, 'not found valid nameservers'
+    if key and err == 'name error' then
+        cache_set(key, nil, err, answers_ttl(nil, negative_ttl))
     end
 
-    if not qname:match('%.') and resolvconf.search then
-        qname = qname .. '.' .. resolvconf.search
+    return nil, err
+end
+
+--[[
+    Sends the query to the nameservers without looking up /etc/hosts and the cache,
+    and returns the raw response message followed by the time in seconds it can be
+    cached for. A nonexistent name is not an error here.
+    opts is the same as query.
+--]]
+function resolver_methods:forward(qname, opts)
+    opts = opts or {}
+
+    local answers, err, negative_ttl, data = resolver_lookup(self, qname, opts)
+    if not data then
+        return nil, err
+    end
+
+    return data, math.min(answers_ttl(answers, negative_ttl), cache.max_ttl)
+end
+
+local resolver_metatable = { __index = resolver_methods }
+
+--[[
+    Creates a resolver, which keeps a UDP socket with a random source port per nameserver,
+    and multiplexes the queries over them. The responses are matched by id and question.
+
+    opts is an optional Table that supports the following fields:
+    nameservers: a list of nameservers to be used. Each nameserver entry can be either a
+                single hostname string or a table holding both the hostname string and the port number.
+                Defaults to the nameservers in /etc/resolv.conf.
+    mark: a number used to set SO_MARK to socket
+    device: a string used to set SO_BINDTODEVICE to socket
+    timeout: the overall timeout of a query in seconds. Defaults to 5.
+    stagger: the delay in seconds before sending the query to the next nameserver if no
+                answer is received yet, 0 queries all nameservers at once. Defaults to 1.
+    retries: the number of times to resend the query to every nameserver. Defaults to 2.
+    edns: the UDP payload size advertised with EDNS0, 0 disables EDNS0. Defaults to 1232.
+                A truncated response is retried over a TCP connection shared by the queries
+                to the same nameserver.
+--]]
+function M.resolver(opts)
+    opts = opts or {}
+
+    local nameservers = parse_nameservers(opts.nameservers or {})
+    local custom = #nameservers > 0
+
+    if not custom then
+        nameservers = parse_resolvconf().nameservers
+    end
+
+    local resolver = setmetatable({
+        custom = custom,
+        mark = opts.mark,
+        device = opts.device,
+        timeout = opts.timeout or 5.0,
+        stagger = opts.stagger or 1.0,
+        retries = opts.retries or 2,
+        edns = opts.edns or 1232,
+        channels = {}
+    }, resolver_metatable)
+
+    for i, nameserver in ipairs(nameservers) do
+        resolver.channels[i] = { nameserver = nameserver, pending = {}, tcp_pending = {}, resolver = resolver }
+    end
+
+    return resolver
+end
+
+-- the resolvers used by query, the active ones are referenced by their channels
+local resolvers = setmetatable({}, { __mode = 'v' })
+
+--[[
+    Queries with a resolver shared with the other queries with the same nameservers,
+    mark and device.
+
+    opts is an optional Table that supports the fields of resolver:query and the following:
+    nameservers, mark, device: see resolver
+--]]
+function M.query(qname, opts)
+    opts = opts or {}
+
+    local nameservers = opts.nameservers
+
+    if not nameservers or #nameservers == 0 then
+        nameservers = parse_resolvconf().nameservers
     end
 
-    local s, answers, req, err
+    local key = {}
 
     for _, nameserver in ipairs(nameservers) do
-        local id = get_next_transaction_id()
+        key[#key + 1] = type(nameserver) == 'table' and (nameserver[1] .. '#' .. (nameserver[2] or 53)) or nameserver
+    end
 
-        req, err = build_request(qname, id, opts)
-        if not req then
-            return nil, err
-        end
+    key[#key + 1] = opts.mark or ''
+    key[#key + 1] = opts.device or ''
 
-        if nameserver[3] then
-            s, err = socket.udp6()
-        else
-            s, err = socket.udp()
-        end
-        if not s then
-            return nil, err
-        end
+    key = table.concat(key, ' ')
 
-        if opts.mark then
-            s:setoption('mark', opts.mark)
-        end
+    local resolver = resolvers[key]
+
+    if not resolver then
+        resolver = M.resolver({ nameservers = opts.nameservers, mark = opts.mark, device = opts.device })
+        resolvers[key] = resolver
+    end
 
-        if opts.device then
-            s:setoption('bindtodevice', opts.device)
+    return resolver:query(qname, opts)
+end
+
+--[[
+    Queries the A and AAAA records concurrently, and returns all the A and AAAA answers.
+    opts is the same as query, except the type field is ignored.
+    It fails only if both of the queries fail.
+--]]
+function M.resolve(qname, opts)
+    local results = {}
+    local wg = sync.waitgroup()
+
+    wg:add(2)
+
+    for i, typ in ipairs({ M.TYPE_A, M.TYPE_AAAA }) do
+        local o = {}
+
+        for k, v in pairs(opts or {}) do
+            o[k] = v
         end
 
-        answers, err = query(s, id, req, nameserver)
-        s:close()
+        o.type = typ
 
-        if answers then
-            return answers
+        eco.run(function()
+            results[i] = { M.query(qname, o) }
+            wg:done()
+        end)
+    end
+
+    wg:wait()
+
+    local answers = {}
+
+    for _, res in ipairs(results) do
+        for _, ans in ipairs(res[1] or {}) do
+            if ans.type == M.TYPE_A or ans.type == M.TYPE_AAAA then
+                answers[#answers + 1] = ans
+            end
         end
     end
 
-    return nil, err
+    if #answers == 0 and not results[1][1] and not results[2][1] then
+        return nil, results[1][2]
+    end
+
+    return answers
+end
+
+--[[
+    Configures the query cache. opts is a table that supports the following fields:
+    size: The max number of cached queries, 0 disables the cache. Defaults to 512.
+    negative_ttl: The time in seconds to cache a nonexistent name or empty answers
+                  if the response doesn't carry a SOA record. Defaults to 30.
+    max_ttl: The upper limit of ttl in seconds. Defaults to 86400.
+--]]
+function M.set_cache(opts)
+    cache.size = opts.size or cache.size
+    cache.negative_ttl = opts.negative_ttl or cache.negative_ttl
+    cache.max_ttl = opts.max_ttl or cache.max_ttl
+
+    while cache.count > cache.size do
+        cache_remove(cache.lru.prev)
+    end
+end
+
+-- Removes all cached queries.
+function M.flush_cache()
+    while cache.count > 0 do
+        cache_remove(cache.lru.prev)
+    end
 end
 
 function M.type_name(n)
@@ -0,0 +1,294 @@
+-- SPDX-License-Identifier: MIT
+-- Author: Jianhui Zhao <zhaojh329@gmail.com>
+
+local dnsc = require 'eco.core.dns'
+local socket = require 'eco.socket'
+local log = require 'eco.log'
+local sync = require 'eco.sync'
+local time = require 'eco.time'
+local dns = require 'eco.dns'
+
+local M = {}
+
+local RCODE_FORMERR  = 1
+local RCODE_SERVFAIL = 2
+local RCODE_NOTIMP   = 4
+
+-- how long to back off after accept fails, e.g. running out of descriptors
+local ACCEPT_BACKOFF = 1.0
+
+--[[
+    A LRU cache of response messages, which are stored in the wire format,
+    so a hit is answered with dnsc.reply only.
+--]]
+local cache_methods = {}
+
+local function cache_unlink(e)
+    e.prev.next = e.next
+    e.next.prev = e.prev
+end
+
+local function cache_push_front(c, e)
+    e.next = c.next
+    e.prev = c
+    c.next.prev = e
+    c.next = e
+end
+
+local function cache_remove(c, e)
+    cache_unlink(e)
+    c.entries[e.key] = nil
+    c.count = c.count - 1
+end
+
+function cache_methods:get(key, now)
+    local e = self.entries[key]
+    if not e then
+        return nil
+    end
+
+    if e.expires <= now then
+        cache_remove(self, e)
+        return nil
+    end
+
+    cache_unlink(e)
+    cache_push_front(self, e)
+
+    return e
+end
+
+function cache_methods:set(key, msg, ttl, now)
+    if self.size < 1 or ttl < 1 then
+        return
+    end
+
+    local e = self.entries[key]
+    if e then
+        cache_remove(self, e)
+    end
+
+    while self.count >= self.size do
+        cache_remove(self, self.prev)
+    end
+
+    e = { key = key, msg = msg, stored = now, expires = now + ttl }
+
+    self.entries[key] = e
+    self.count = self.count + 1
+
+    cache_push_front(self, e)
+
+    return e
+end
+
+local cache_metatable = { __index = cache_methods }
+
+local function new_cache(size)
+    local c = setmetatable({ size = size, count = 0, entries = {} }, cache_metatable)
+
+    c.prev = c
+    c.next = c
+
+    return c
+end
+
+-- looks up the upstream nameservers, the identical queries in flight are coalesced
+local function forward(srv, key, qname, qtype, rd)
+    local pending = srv.inflight[key]
+    if pending then
+        pending.cond:wait(srv.timeout + 1.0)
+        return pending.msg, pending.ttl
+    end
+
+    pending = { cond = sync.cond() }
+    srv.inflight[key] = pending
+
+    local msg, ttl = srv.resolver:forward(qname, {
+        type = qtype,
+        no_recurse = not rd
+    })
+
+    srv.inflight[key] = nil
+
+    pending.msg, pending.ttl = msg, ttl
+    pending.cond:broadcast()
+
+    return msg, ttl
+end
+
+--[[
+    Returns the reply of the query, or nil if the query should be dropped.
+    If the answer isn't cached and nowait is true, it returns false.
+--]]
+local function handle_query(srv, query, tcp, nowait)
+    local qname, qtype, qclass, flags, udp_size = dnsc.parse_query(query)
+    if not qname then
+        if #query < 12 or query:byte(3) & 0x80 ~= 0 then
+            return nil
+        end
+
+        return dnsc.error_reply(query, RCODE_FORMERR)
+    end
+
+    -- responses
+    if flags & 0x8000 ~= 0 then
+        return nil
+    end
+
+    -- only the standard query is supported
+    if flags & 0x7800 ~= 0 or qclass ~= dns.CLASS_IN then
+        return dnsc.error_reply(query, RCODE_NOTIMP)
+    end
+
+    local rd = flags & 0x0100 ~= 0
+    local key = qname .. (rd and ' ' or ' norecurse ') .. qtype
+    local now = time.now()
+
+    local e = srv.cache:get(key, now)
+
+    if not e then
+        if nowait then
+            return false
+        end
+
+        local msg, ttl = forward(srv, key, qname, qtype, rd)
+        if not msg then
+            return dnsc.error_reply(query, RCODE_SERVFAIL)
+        end
+
+        e = srv.cache:set(key, msg, ttl, now) or { msg = msg, stored = now }
+    end
+
+    -- the reply over UDP is limited to the UDP payload size of the client
+    local limit = 0
+
+    if not tcp then
+        limit = math.max(udp_size, 512)
+    end
+
+    return dnsc.reply(e.msg, query, math.floor(now - e.stored), limit, udp_size > 0)
+end
+
+local function serve_tcp(srv, sock)
+    while true do
+        local data = sock:recvfull(2, 10.0)
+        if not data then
+            break
+        end
+
+        data = sock:recvfull(string.unpack('>I2', data), 5.0)
+        if not data then
+            break
+        end
+
+        local reply = handle_query(srv, data, true)
+        if reply then
+            if not sock:send(string.pack('>s2', reply)) then
+                break
+            end
+        end
+    end
+
+    sock:close()
+end
+
+--[[
+    Runs a caching DNS forwarder on UDP and TCP. It doesn't return unless receiving
+    on UDP fails, then both listeners are closed and it returns nil and the error.
+    A failing accept on TCP is logged and retried after a while.
+
+    options is an optional Table that supports the following fields:
+    nameservers: the upstream nameservers, see dns.resolver. Defaults to the nameservers
+                 in /etc/resolv.conf, which must not point to the forwarder itself.
+    mark, device, timeout, stagger, retries, edns: options of the upstream resolver, see dns.resolver
+    cache_size: The max number of cached responses, 0 disables the cache. Defaults to 4096.
+    tcp: a boolean flag controls whether to serve TCP. Defaults to true.
+    reuseaddr, reuseport: see socket.listen_udp
+
+    Cache hits are answered inline, and the misses in a coroutine each.
+--]]
+function M.listen(ipaddr, port, options)
+    options = options or {}
+
+    local ipv6 = ipaddr and socket.is_ipv6_address(ipaddr)
+
+    local srv = {
+        resolver = dns.resolver({
+            nameservers = options.nameservers,
+            mark = options.mark,
+            device = options.device,
+            timeout = options.timeout,
+            stagger = options.stagger,
+            retries = options.retries,
+            edns = options.edns
+        }),
+        timeout = options.timeout or 5.0,
+        cache = new_cache(options.cache_size or 4096),
+        inflight = {}
+    }
+
+    local sock_opts = { ipv6 = ipv6, reuseaddr = options.reuseaddr, reuseport = options.reuseport }
+
+    local udp, err = socket.listen_udp(ipaddr, port or 53, sock_opts)
+    if not udp then
+        return nil, err
+    end
+
+    local tcp
+
+    if options.tcp ~= false then
+        tcp, err = socket.listen_tcp(ipaddr, port or 53, sock_opts)
+        if not tcp then
+            udp:close()
+            return nil, err
+        end
+
+        eco.run(function()
+            while true do
+                local c, err = tcp:accept()
+                if c then
+                    eco.run(serve_tcp, srv, c)
+                elseif srv.closed then
+                    break
+                else
+                    log.err('dns server: accept:', err)
+                    time.sleep(ACCEPT_BACKOFF)
+                end
+            end
+
+            tcp:close()
+        end)
+    end
+
+    while true do
+        local query, peer = udp:recvfrom(4096)
+        if not query then
+            srv.closed = true
+
+            -- wakes up the accept coroutine, which closes the listener
+            if tcp then
+                tcp:shutdown()
+            end
+
+            udp:close()
+
+            return nil, peer
+        end
+
+        local reply = handle_query(srv, query, false, true)
+
+        if reply then
+            udp:sendto(reply, peer.ipaddr, peer.port)
+        elseif reply == false then
+            eco.run(function()
+                reply = handle_query(srv, query)
+                if reply then
+                    udp:sendto(reply, peer.ipaddr, peer.port)
+                end
+            end)
+        end
+    end
+end
+
+return M
@@ -726,7 +726,7 @@ int main(int argc, char *const argv[])
     lua_getfield(L, -1, "run");
     lua_remove(L, -2);
 
-    while ((opt = getopt(argc, argv, "e:v")) != -1) {
+    while ((opt = getopt(argc, argv, "+e:v")) != -1) {
         switch (opt)
         {
         case 'v':
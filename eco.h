@@ -6,6 +6,7 @@
 #ifndef __ECO_H
 #define __ECO_H
 
+#include <sys/mman.h>
 #include <string.h>
 #include <lauxlib.h>
 #include <lua.h>
@@ -18,6 +19,62 @@ struct eco_context {
     lua_State *L;
 };
 
+#define ECO_FILE_MMAP_MT "eco{file-mmap}"
+
+/* a read only memory mapped file, see file.mmap */
+struct eco_file_mmap {
+    const char *addr;
+    size_t len;
+    void *base;
+    size_t maplen;
+    int pins;       /* the sendings in progress, which defer the unmapping */
+};
+
+static inline void eco_file_mmap_pin(struct eco_file_mmap *m)
+{
+    m->pins++;
+}
+
+/* unmaps the file if it has been closed while pinned */
+static inline void eco_file_mmap_unpin(struct eco_file_mmap *m)
+{
+    if (--m->pins > 0 || m->addr || !m->base)
+        return;
+
+    munmap(m->base, m->maplen);
+    m->base = NULL;
+}
+
+static inline size_t eco_file_mmap_posrelat(lua_Integer pos, size_t len)
+{
+    if (pos >= 0)
+        return (size_t)pos;
+    else if (0u - (size_t)pos > len)
+        return 0;
+    else
+        return len + (size_t)pos + 1;
+}
+
+/*
+ * Gets the range of the arguments i and j at idx and idx + 1 as string.sub
+ * does, returns the length of it and stores the offset of it in start.
+ */
+static inline size_t eco_file_mmap_range(lua_State *L, struct eco_file_mmap *m, int idx, size_t *start)
+{
+    size_t i = eco_file_mmap_posrelat(luaL_optinteger(L, idx, 1), m->len);
+    size_t j = eco_file_mmap_posrelat(luaL_optinteger(L, idx + 1, -1), m->len);
+
+    if (i < 1)
+        i = 1;
+
+    if (j > m->len)
+        j = m->len;
+
+    *start = i - 1;
+
+    return i > j ? 0 : j - i + 1;
+}
+
 #ifndef ev_io_modify
 #define ev_io_modify(ev,events_) do { (ev)->events = ((ev)->events & EV__IOFDSET) | (events_); } while (0)
 #endif
@@ -25,3 +25,30 @@ if status.exited then
 elseif status.signaled then
     print('terminated by a signal:', status.status)
 end
+
+-- the last table argument holds the options
+p = sys.exec('sh', '-c', 'echo $GREETING from $(pwd); cat', {
+    env = { GREETING = 'hello' },
+    cwd = '/tmp',
+    stdin = true
+})
+
+p:write_stdin('data from stdin\n')
+p:close_stdin()
+
+p:wait(10.0)
+
+print('stdout: ', p:read_stdout('*a'))
+
+-- the stages of a pipeline are connected by pipes directly
+p = sys.pipeline({{ 'printf', 'one\ntwo\nthree\n' }, { 'grep', 't' }, { 'sort', '-r' }})
+
+local statuses = p:wait(10.0)
+
+print('pipeline stdout: ', p:read_stdout('*a'))
+
+for i, st in ipairs(statuses) do
+    print('stage ' .. i .. ' exit status:', st.status)
+end
+
+p:release()
@@ -0,0 +1,37 @@
+#!/usr/bin/env eco
+
+-- Measures the processes executed per second, with a Lua heap of the given size,
+-- since the cost of fork grows with the size of the address space.
+-- Usage: exec_bench.lua [count] [heap MB]
+
+local sys = require 'eco.sys'
+local time = require 'eco.time'
+
+local count = tonumber(arg[1]) or 1000
+local heap = tonumber(arg[2]) or 0
+
+local ballast = {}
+
+for i = 1, heap * 1024 do
+    ballast[i] = string.rep(string.char(i % 256), 1024 - 32)
+end
+
+local start = time.now()
+
+for _ = 1, count do
+    local p, err = sys.exec('true')
+    if not p then
+        print('exec fail:', err)
+        os.exit(1)
+    end
+
+    p:wait()
+    p:release()
+end
+
+local elapsed = time.now() - start
+
+print(string.format('heap: %.1fMB, %d processes in %.3fs', collectgarbage('count') / 1024, count, elapsed))
+print(string.format('Processes/sec: %.2f', count / elapsed))
+
+os.exit(0)
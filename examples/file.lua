@@ -20,3 +20,52 @@ end
 print(file.readfile('/etc/os-release'))
 
 file.writefile('/tmp/eco-test', 'I am eco\n')
+
+
+-- the operations of file.aio run in a worker pool and only suspend the calling coroutine
+local fd = file.aio.open('/tmp/eco-test', file.O_RDWR)
+if fd then
+    print(file.aio.pread(fd, 3, 5))
+    file.aio.pwrite(fd, 'ECO', 5)
+    file.aio.fsync(fd)
+    file.aio.close(fd)
+end
+
+print(file.aio.stat('/tmp/eco-test').size)
+print(table.concat(file.aio.readdir('/tmp'), ' '))
+
+-- scan a file through a read only mapping, without reading it into Lua strings
+local m = file.mmap('/etc/services', { advise = 'sequential' })
+if m then
+    local s, e = m:find('http')
+    if s then
+        print(m:sub(s, e), 'at', s)
+    end
+
+    local n = 0
+    for line in m:lines() do
+        if line:byte(1) ~= 35 then n = n + 1 end
+    end
+    print(n, 'entries')
+
+    m:close()
+end
+
+-- concurrent coroutines appending records, their syncs are committed by one fdatasync
+local journal = file.appender('/tmp/eco-journal')
+if journal then
+    local wg = require 'eco.sync'.waitgroup()
+
+    wg:add(10)
+
+    for i = 1, 10 do
+        eco.run(function()
+            journal:write('record ' .. i .. '\n')
+            journal:sync()
+            wg:done()
+        end)
+    end
+
+    wg:wait()
+    journal:close()
+end
@@ -0,0 +1,33 @@
+#!/usr/bin/env eco
+
+local inotify = require 'eco.inotify'
+
+local w, err = inotify.new({ debounce = 0.1 })
+if not w then
+    print(err)
+    return
+end
+
+local ok, err = w:add('/tmp', nil, { recursive = true })
+if not ok then
+    print(err)
+    return
+end
+
+for events in w:events() do
+    for _, ev in ipairs(events) do
+        if ev.mask & inotify.IN_Q_OVERFLOW > 0 then
+            print('events lost, rescan')
+        else
+            local what = {}
+
+            if ev.mask & inotify.IN_CREATE > 0 then what[#what + 1] = 'create' end
+            if ev.mask & inotify.IN_MODIFY > 0 then what[#what + 1] = 'modify' end
+            if ev.mask & inotify.IN_CLOSE_WRITE > 0 then what[#what + 1] = 'close_write' end
+            if ev.mask & inotify.IN_DELETE > 0 then what[#what + 1] = 'delete' end
+            if ev.mask & inotify.IN_MOVE > 0 then what[#what + 1] = 'move' end
+
+            print(ev.path, table.concat(what, ' '))
+        end
+    end
+end
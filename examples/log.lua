@@ -26,3 +26,32 @@ log.log(log.LOG_WARNING, 'eco')
 log.set_path('/tmp/eco.log')
 
 log.info('eco')
+
+-- write the messages from a background thread, the loop never waits for the sink
+log.async({ size = 1024 * 1024, overflow = 'count' })
+
+for i = 1, 1000 do
+    log.info('async', i)
+end
+
+-- waits until all the queued messages are written
+log.flush()
+
+local stats = log.stats()
+print('queued:', stats.queued, 'written:', stats.written, 'dropped:', stats.dropped)
+
+-- structured logging, the last table argument holds the fields
+log.set_format('json')  -- 'text', 'json' or 'logfmt'
+
+log.info('request done', { status = 200, path = '/index.html', elapsed = 0.012 })
+
+-- the functions are called only if the message is logged
+log.debug('payload', { dump = function() return string.rep('x', 1024) end })
+log.debug(function() return string.format('%d items', 10) end)
+
+-- each callsite logs at most 10 messages per second, with bursts of up to 20,
+-- the next message allowed is preceded by a "suppressed" summary with the field count
+log.set_rate_limit(10, 20)
+
+-- logs 1% of the debug messages
+log.set_sampling(0.01)
@@ -0,0 +1,95 @@
+#!/usr/bin/env eco
+
+-- Measures the queries per second of the caching DNS forwarder on localhost.
+-- Usage: dns_server_bench.lua [clients] [seconds]
+
+local dns_server = require 'eco.dns.server'
+local dnsc = require 'eco.core.dns'
+local socket = require 'eco.socket'
+local sync = require 'eco.sync'
+local time = require 'eco.time'
+
+local clients = tonumber(arg[1]) or 16
+local duration = tonumber(arg[2]) or 5
+
+local upstream_port = 20053
+local port = 10053
+
+-- a static upstream nameserver, which answers every A query with 127.0.0.1
+eco.run(function()
+    local s = assert(socket.listen_udp('127.0.0.1', upstream_port))
+
+    while true do
+        local query, peer = s:recvfrom(512)
+        if query then
+            local qname, qtype = dnsc.parse_query(query)
+            if qname then
+                local id = string.unpack('>I2', query)
+                local question = query:sub(13, 12 + #qname + 2 + 4)
+                local answer = qtype == 1 and 1 or 0
+                local resp = string.pack('>I2I2I2I2I2I2', id, 0x8180, 1, answer, 0, 0) .. question
+
+                if answer > 0 then
+                    resp = resp .. '\xc0\x0c' .. string.pack('>I2I2I4I2', 1, 1, 300, 4) .. '\127\0\0\1'
+                end
+
+                s:sendto(resp, peer.ipaddr, peer.port)
+            end
+        end
+    end
+end)
+
+eco.run(function()
+    local ok, err = dns_server.listen('127.0.0.1', port, {
+        nameservers = {{ '127.0.0.1', upstream_port }},
+        reuseaddr = true
+    })
+    if not ok then
+        print('listen fail:', err)
+        os.exit(1)
+    end
+end)
+
+time.sleep(0.1)
+
+local names = {}
+
+for i = 1, 100 do
+    names[i] = dnsc.encode_query(i, 0x0100, 'host' .. i .. '.example.com', 1)
+end
+
+local wg = sync.waitgroup()
+local deadline = time.now() + duration
+local total = 0
+local errors = 0
+
+wg:add(clients)
+
+for _ = 1, clients do
+    eco.run(function()
+        local s = socket.connect_udp('127.0.0.1', port)
+        local i = 0
+
+        while time.now() < deadline do
+            i = i % #names + 1
+
+            s:send(names[i])
+
+            if s:recv(512, 1.0) then
+                total = total + 1
+            else
+                errors = errors + 1
+            end
+        end
+
+        s:close()
+        wg:done()
+    end)
+end
+
+wg:wait()
+
+print(string.format('%d clients, %d queries in %ds, %d errors', clients, total, duration, errors))
+print(string.format('Queries/sec: %.2f', total / duration))
+
+os.exit(0)
@@ -0,0 +1,26 @@
+#!/usr/bin/env eco
+
+local http = require 'eco.http.client'
+
+local requests = {
+    'http://127.0.0.1:8080/a',
+    'http://127.0.0.1:8080/b',
+    { method = 'POST', url = 'http://127.0.0.1:8080/c', body = 'hello' },
+    { url = 'http://127.0.0.1:8080/d', opts = { timeout = 1.0 } }
+}
+
+local results = http.batch(requests, {
+    concurrency = 2,
+    timeout = 5.0,
+    on_response = function(i, resp, err)
+        print('request', i, 'completed:', resp and resp.code or err)
+    end
+})
+
+for i, res in ipairs(results) do
+    if res.resp then
+        print(i, res.resp.code, res.resp.body)
+    else
+        print(i, 'fail:', res.err)
+    end
+end
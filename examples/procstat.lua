@@ -0,0 +1,32 @@
+#!/usr/bin/env eco
+
+-- Prints the resource metrics of the process and of a child every second.
+
+local sys = require 'eco.sys'
+local time = require 'eco.time'
+
+local function show(name, st)
+    print(string.format('%-8s cpu: %.2fs rss: %dKB pss: %sKB fds: %s ctxsw: %d/%d io: %s/%s bytes',
+        name, st.utime + st.stime, st.rss // 1024, st.pss and st.pss // 1024 or '-',
+        st.fds or '-', st.nvcsw, st.nivcsw, st.rchar or '-', st.wchar or '-'))
+end
+
+local p = assert(sys.exec('sh', '-c', 'for i in 1 2 3; do head -c 1000000 /dev/urandom | md5sum; sleep 1; done'))
+
+for _ = 1, 3 do
+    show('self', assert(sys.procstat()))
+
+    local st = p:procstat()
+    if st then
+        show('child', st)
+    end
+
+    time.sleep(1)
+end
+
+p:wait(5.0)
+p:release()
+
+local ru = sys.rusage('children')
+
+print(string.format('children cpu: %.2fs maxrss: %dKB', ru.utime + ru.stime, ru.maxrss // 1024))
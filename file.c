@@ -5,17 +5,100 @@
 
 #include <sys/sendfile.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/file.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fnmatch.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <libgen.h>
+#include <limits.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include "eco.h"
 
 #define ECO_FILE_DIR_MT "eco{file-dir}"
+#define ECO_FILE_WALK_MT "eco{file-walk}"
+
+#define ECO_FILE_WALK_BUF (32 * 1024)
+
+#define ECO_FILE_AIO_MAX_THREADS 4
+#define ECO_FILE_AIO_READDIR_BUF 4096
+#define ECO_FILE_AIO_COPY_BUF (64 * 1024)
+
+/* the buffers are aligned for the files opened with O_DIRECT */
+#define ECO_FILE_AIO_ALIGN 4096
+
+enum {
+    AIO_OPEN,
+    AIO_CLOSE,
+    AIO_PREAD,
+    AIO_PWRITE,
+    AIO_FSYNC,
+    AIO_FDATASYNC,
+    AIO_STAT,
+    AIO_READDIR,
+    AIO_RENAME,
+    AIO_UNLINK,
+    AIO_COPY,
+    AIO_WRITEV,
+    AIO_SYNC,
+    AIO_READAHEAD
+};
+
+/* the methods of AIO_COPY, each falls back to the next one */
+enum {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE
+};
+
+/*
+ * A request executed by the worker pool. The strings it points to are
+ * the arguments of the calling coroutine, which are kept on its stack
+ * until it's resumed.
+ */
+struct eco_file_aio {
+    struct eco_file_aio *next;
+    lua_State *co;
+    int op;
+    int fd;
+    int outfd;
+    int flags;
+    mode_t mode;
+    off_t offset;
+    const char *path;
+    const char *newpath;
+    const void *data;
+    size_t len;
+    void *buf;
+    struct iovec *iov;
+    int iovcnt;
+    struct stat st;
+    ssize_t ret;
+    int err;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct eco_file_aio *head;
+    struct eco_file_aio *tail;
+    struct eco_file_aio *done;
+    struct eco_context *eco;
+    struct ev_async async;
+    int nthreads;
+    int idle;
+    int pending;
+} aio_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
 
 static int lua_file_open(lua_State *L)
 {
@@ -164,10 +247,9 @@ static int lua_readlink(lua_State *L)
     return 1;
 }
 
-static int __lua_file_stat(lua_State *L, struct stat *st)
+/* sets the fields of the stat to the table on the top of the stack */
+static void lua_file_stat_fields(lua_State *L, struct stat *st)
 {
-    lua_newtable(L);
-
     switch (st->st_mode & S_IFMT) {
     case S_IFBLK: lua_pushliteral(L, "BLK");  break;
     case S_IFCHR: lua_pushliteral(L, "CHR");  break;
@@ -207,6 +289,15 @@ static int __lua_file_stat(lua_State *L, struct stat *st)
     lua_pushinteger(L, st->st_ino);
     lua_setfield(L, -2, "ino");
 
+    lua_pushinteger(L, st->st_dev);
+    lua_setfield(L, -2, "dev");
+}
+
+static int __lua_file_stat(lua_State *L, struct stat *st)
+{
+    lua_newtable(L);
+    lua_file_stat_fields(L, st);
+
     return 1;
 }
 
@@ -325,128 +416,1892 @@ static const struct luaL_Reg dir_methods[] =  {
     {NULL, NULL}
 };
 
-static int lua_file_chown(lua_State *L)
+/* a closed mapping is empty */
+static inline struct eco_file_mmap *mmap_check(lua_State *L)
 {
-    const char *pathname = luaL_checkstring(L, 1);
-    uid_t uid = -1;
-    gid_t gid = -1;
+    return luaL_checkudata(L, 1, ECO_FILE_MMAP_MT);
+}
 
-    if (lua_isnumber(L, 2))
-        uid = (uid_t)lua_tointeger(L, 2);
+static int lua_mmap_len(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
 
-    if (lua_isnumber(L, 3))
-        gid = (gid_t)lua_tointeger(L, 3);
+    lua_pushinteger(L, m->len);
+    return 1;
+}
 
-    if (chown(pathname, uid, gid)) {
-        lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
-        return 2;
-    }
+static int lua_mmap_sub(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+    size_t start;
+    size_t len = eco_file_mmap_range(L, m, 2, &start);
 
-    lua_pushboolean(L, true);
+    lua_pushlstring(L, m->addr + start, len);
+    return 1;
+}
+
+static int lua_mmap_byte(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+    size_t pos = eco_file_mmap_posrelat(luaL_optinteger(L, 2, 1), m->len);
+
+    if (pos < 1 || pos > m->len)
+        return 0;
 
+    lua_pushinteger(L, (uint8_t)m->addr[pos - 1]);
     return 1;
 }
 
-static int lua_file_dirname(lua_State *L)
+/* finds the plain string from init, returns the start and end positions */
+static int lua_mmap_find(lua_State *L)
 {
-    const char *path = luaL_checkstring(L, 1);
-    char *buf = strdup(path);
+    struct eco_file_mmap *m = mmap_check(L);
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    size_t init = eco_file_mmap_posrelat(luaL_optinteger(L, 3, 1), m->len);
+    const char *p;
 
-    lua_pushstring(L, dirname(buf));
-    free(buf);
+    if (init < 1)
+        init = 1;
+
+    if (init > m->len + 1)
+        return 0;
+
+    p = memmem(m->addr + init - 1, m->len - init + 1, s, len);
+    if (!p)
+        return 0;
+
+    lua_pushinteger(L, p - m->addr + 1);
+    lua_pushinteger(L, p - m->addr + len);
+    return 2;
+}
+
+/* finds the byte, which is an integer or a single character string */
+static int lua_mmap_memchr(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+    size_t init = eco_file_mmap_posrelat(luaL_optinteger(L, 3, 1), m->len);
+    const char *p;
+    int c;
+
+    if (lua_type(L, 2) == LUA_TSTRING)
+        c = *lua_tostring(L, 2);
+    else
+        c = luaL_checkinteger(L, 2);
+
+    if (init < 1)
+        init = 1;
 
+    if (init > m->len)
+        return 0;
+
+    p = memchr(m->addr + init - 1, c, m->len - init + 1);
+    if (!p)
+        return 0;
+
+    lua_pushinteger(L, p - m->addr + 1);
     return 1;
 }
 
-static int lua_file_basename(lua_State *L)
+/* reads an integer of 1, 2, 4 or 8 bytes at pos, which is little endian unless big is true */
+static int __lua_mmap_int(lua_State *L, bool is_signed)
 {
-    const char *path = luaL_checkstring(L, 1);
-    char *buf = strdup(path);
+    struct eco_file_mmap *m = mmap_check(L);
+    lua_Integer pos = luaL_checkinteger(L, 2);
+    int size = luaL_optinteger(L, 3, 4);
+    bool big = lua_toboolean(L, 4);
+    const uint8_t *p;
+    uint64_t v = 0;
+    int i;
 
-    lua_pushstring(L, basename(buf));
-    free(buf);
+    luaL_argcheck(L, size == 1 || size == 2 || size == 4 || size == 8, 3, "must be 1, 2, 4 or 8");
+
+    if (pos < 1 || pos - 1 + size > m->len)
+        return 0;
+
+    p = (const uint8_t *)m->addr + pos - 1;
 
+    for (i = 0; i < size; i++)
+        v |= (uint64_t)p[big ? size - 1 - i : i] << (i * 8);
+
+    if (is_signed && size < 8 && (v & ((uint64_t)1 << (size * 8 - 1))))
+        v |= ~(uint64_t)0 << (size * 8);
+
+    lua_pushinteger(L, (lua_Integer)v);
     return 1;
 }
 
-static int lua_file_flock(lua_State *L)
+static int lua_mmap_uint(lua_State *L)
 {
-    int fd = luaL_checkinteger(L, 1);
-    int operation = luaL_checkinteger(L, 2);
+    return __lua_mmap_int(L, false);
+}
 
-    if (flock(fd, operation | LOCK_NB)) {
+static int lua_mmap_int(lua_State *L)
+{
+    return __lua_mmap_int(L, true);
+}
+
+static int eco_mmap_lines_iter(lua_State *L)
+{
+    struct eco_file_mmap *m = luaL_checkudata(L, lua_upvalueindex(1), ECO_FILE_MMAP_MT);
+    size_t pos = lua_tointeger(L, lua_upvalueindex(2));
+    const char *start, *nl;
+    size_t len;
+
+    if (!m->base || pos >= m->len)
+        return 0;
+
+    start = m->addr + pos;
+    nl = memchr(start, '\n', m->len - pos);
+
+    len = nl ? nl - start : m->len - pos;
+
+    lua_pushinteger(L, pos + len + 1);
+    lua_replace(L, lua_upvalueindex(2));
+
+    lua_pushlstring(L, start, len);
+    lua_pushinteger(L, pos + 1);
+    return 2;
+}
+
+/* iterates the lines from init, returns each line without the newline and its position */
+static int lua_mmap_lines(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+    size_t init = eco_file_mmap_posrelat(luaL_optinteger(L, 2, 1), m->len);
+
+    if (init < 1)
+        init = 1;
+
+    lua_settop(L, 1);
+    lua_pushinteger(L, init - 1);
+    lua_pushcclosure(L, eco_mmap_lines_iter, 2);
+
+    return 1;
+}
+
+static int mmap_advice(lua_State *L, int idx)
+{
+    const char *advice = luaL_checkstring(L, idx);
+
+    if (!strcmp(advice, "normal"))
+        return MADV_NORMAL;
+    else if (!strcmp(advice, "random"))
+        return MADV_RANDOM;
+    else if (!strcmp(advice, "sequential"))
+        return MADV_SEQUENTIAL;
+    else if (!strcmp(advice, "willneed"))
+        return MADV_WILLNEED;
+    else if (!strcmp(advice, "dontneed"))
+        return MADV_DONTNEED;
+
+    return luaL_argerror(L, idx, "invalid advice");
+}
+
+/* advises the kernel about the range from i to j, defaults to the whole mapping */
+static int lua_mmap_advise(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+    int advice = mmap_advice(L, 2);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t addr;
+    size_t start;
+    size_t len = eco_file_mmap_range(L, m, 3, &start);
+
+    if (len == 0) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    /* madvise requires a page aligned address */
+    addr = (uintptr_t)(m->addr + start);
+    len += addr % pagesize;
+    addr -= addr % pagesize;
+
+    if (madvise((void *)addr, len, advice)) {
         lua_pushnil(L);
-        lua_pushinteger(L, errno);
+        lua_pushstring(L, strerror(errno));
         return 2;
     }
 
     lua_pushboolean(L, true);
-
     return 1;
 }
 
-static const luaL_Reg funcs[] = {
-    {"open", lua_file_open},
-    {"close", lua_file_close},
-    {"read", lua_file_read},
-    {"write", lua_file_write},
-    {"lseek", lua_file_lseek},
-    {"access", lua_file_access},
-    {"readlink", lua_readlink},
-    {"stat", lua_file_stat},
-    {"fstat", lua_file_fstat},
-    {"statvfs", lua_file_statvfs},
-    {"chown", lua_file_chown},
-    {"dirname", lua_file_dirname},
-    {"basename", lua_file_basename},
-    {"flock", lua_file_flock},
+static void mmap_unmap(struct eco_file_mmap *m)
+{
+    if (m->base) {
+        munmap(m->base, m->maplen);
+        m->base = NULL;
+    }
+
+    m->addr = NULL;
+    m->len = 0;
+}
+
+/*
+ * The mapping becomes empty at once, but the unmapping is deferred until
+ * the sendings of it in progress(see socket send) finished.
+ */
+static int lua_mmap_close(lua_State *L)
+{
+    struct eco_file_mmap *m = mmap_check(L);
+
+    if (m->pins > 0) {
+        m->addr = NULL;
+        m->len = 0;
+        return 0;
+    }
+
+    mmap_unmap(m);
+
+    return 0;
+}
+
+/* a pinned mapping is garbage only if the coroutines sending it are, which never resume */
+static int lua_mmap_gc(lua_State *L)
+{
+    mmap_unmap(mmap_check(L));
+    return 0;
+}
+
+static const struct luaL_Reg mmap_methods[] =  {
+    {"len", lua_mmap_len},
+    {"sub", lua_mmap_sub},
+    {"byte", lua_mmap_byte},
+    {"find", lua_mmap_find},
+    {"memchr", lua_mmap_memchr},
+    {"uint", lua_mmap_uint},
+    {"int", lua_mmap_int},
+    {"lines", lua_mmap_lines},
+    {"advise", lua_mmap_advise},
+    {"close", lua_mmap_close},
+    {"__len", lua_mmap_len},
+    {"__gc", lua_mmap_gc},
     {NULL, NULL}
 };
 
-int luaopen_eco_core_file(lua_State *L)
+/*
+ * Maps a file read only. The optional table opts supports offset, length,
+ * advise(see advise method) and populate(prefault the pages).
+ */
+static int lua_file_mmap(lua_State *L)
 {
-    luaL_newlib(L, funcs);
+    const char *path = luaL_checkstring(L, 1);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int flags = MAP_SHARED;
+    struct eco_file_mmap *m;
+    const char *advise = NULL;
+    lua_Integer length = -1;
+    lua_Integer offset = 0;
+    size_t delta;
+    struct stat st;
+    int fd;
 
-    lua_add_constant(L, "O_RDONLY", O_RDONLY);
-    lua_add_constant(L, "O_WRONLY", O_WRONLY);
-    lua_add_constant(L, "O_RDWR", O_RDWR);
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "offset");
+        offset = luaL_optinteger(L, -1, 0);
 
-    lua_add_constant(L, "O_APPEND", O_APPEND);
-    lua_add_constant(L, "O_CLOEXEC", O_CLOEXEC);
-    lua_add_constant(L, "O_CREAT", O_CREAT);
-    lua_add_constant(L, "O_EXCL", O_EXCL);
-    lua_add_constant(L, "O_NOCTTY", O_NOCTTY);
-    lua_add_constant(L, "O_NONBLOCK", O_NONBLOCK);
-    lua_add_constant(L, "O_TRUNC", O_TRUNC);
+        lua_getfield(L, 2, "length");
+        length = luaL_optinteger(L, -1, -1);
 
-    lua_add_constant(L, "S_IRWXU", S_IRWXU);
-    lua_add_constant(L, "S_IRUSR", S_IRUSR);
-    lua_add_constant(L, "S_IWUSR", S_IWUSR);
-    lua_add_constant(L, "S_IXUSR", S_IXUSR);
-    lua_add_constant(L, "S_IRWXG", S_IRWXG);
-    lua_add_constant(L, "S_IRGRP", S_IRGRP);
-    lua_add_constant(L, "S_IWGRP", S_IWGRP);
-    lua_add_constant(L, "S_IXGRP", S_IXGRP);
-    lua_add_constant(L, "S_IRWXO", S_IRWXO);
-    lua_add_constant(L, "S_IROTH", S_IROTH);
-    lua_add_constant(L, "S_IWOTH", S_IWOTH);
-    lua_add_constant(L, "S_IXOTH", S_IXOTH);
-    lua_add_constant(L, "S_ISUID", S_ISUID);
-    lua_add_constant(L, "S_ISGID", S_ISGID);
-    lua_add_constant(L, "S_ISVTX", S_ISVTX);
+        lua_getfield(L, 2, "advise");
+        advise = lua_tostring(L, -1);
 
-    lua_add_constant(L, "SEEK_SET", SEEK_SET);
-    lua_add_constant(L, "SEEK_CUR", SEEK_CUR);
-    lua_add_constant(L, "SEEK_END", SEEK_END);
+        lua_getfield(L, 2, "populate");
+        if (lua_toboolean(L, -1))
+            flags |= MAP_POPULATE;
 
-    lua_add_constant(L, "LOCK_SH", LOCK_SH);
-    lua_add_constant(L, "LOCK_EX", LOCK_EX);
-    lua_add_constant(L, "LOCK_UN", LOCK_UN);
+        lua_pop(L, 4);
+    }
 
-    eco_new_metatable(L, ECO_FILE_DIR_MT, dir_methods);
-    lua_pushcclosure(L, lua_file_dir, 1);
-    lua_setfield(L, -2, "dir");
+    luaL_argcheck(L, offset >= 0, 2, "offset must not be negative");
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto err;
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        goto err;
+    }
+
+    if (offset > st.st_size)
+        offset = st.st_size;
+
+    if (length < 0 || length > st.st_size - offset)
+        length = st.st_size - offset;
+
+    m = lua_newuserdata(L, sizeof(struct eco_file_mmap));
+    memset(m, 0, sizeof(struct eco_file_mmap));
+    luaL_setmetatable(L, ECO_FILE_MMAP_MT);
+
+    if (length == 0) {
+        close(fd);
+        return 1;
+    }
+
+    /* the offset of mmap must be a multiple of the page size */
+    delta = offset % pagesize;
+
+    m->maplen = length + delta;
+    m->base = mmap(NULL, m->maplen, PROT_READ, flags, fd, offset - delta);
+    close(fd);
+
+    if (m->base == MAP_FAILED) {
+        m->base = NULL;
+        goto err;
+    }
+
+    m->addr = (const char *)m->base + delta;
+    m->len = length;
+
+    if (advise) {
+        lua_pushcfunction(L, lua_mmap_advise);
+        lua_pushvalue(L, -2);
+        lua_pushstring(L, advise);
+        lua_call(L, 2, 0);
+    }
+
+    return 1;
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+}
+
+struct walk_pending {
+    char *path;
+    int depth;
+};
+
+struct eco_file_walk {
+    int fd;
+    int depth;
+    char path[PATH_MAX];
+    size_t pathlen;
+    char *buf;
+    long bpos;
+    long blen;
+    struct walk_pending *stack;
+    size_t nstack;
+    size_t capstack;
+    int max_depth;
+    uint32_t types;
+    char *match;
+    char *exclude;
+    bool stat;
+};
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const char *walk_type_name(unsigned char type)
+{
+    switch (type) {
+    case DT_BLK:  return "BLK";
+    case DT_CHR:  return "CHR";
+    case DT_DIR:  return "DIR";
+    case DT_FIFO: return "FIFO";
+    case DT_LNK:  return "LNK";
+    case DT_REG:  return "REG";
+    case DT_SOCK: return "SOCK";
+    default:      return "";
+    }
+}
+
+static unsigned char walk_mode_to_type(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFBLK:  return DT_BLK;
+    case S_IFCHR:  return DT_CHR;
+    case S_IFDIR:  return DT_DIR;
+    case S_IFIFO:  return DT_FIFO;
+    case S_IFLNK:  return DT_LNK;
+    case S_IFREG:  return DT_REG;
+    case S_IFSOCK: return DT_SOCK;
+    default:       return DT_UNKNOWN;
+    }
+}
+
+static int walk_push(struct eco_file_walk *w, const char *path, int depth)
+{
+    if (w->nstack == w->capstack) {
+        size_t cap = w->capstack ? w->capstack * 2 : 16;
+        struct walk_pending *stack = realloc(w->stack, cap * sizeof(struct walk_pending));
+
+        if (!stack)
+            return -1;
+
+        w->stack = stack;
+        w->capstack = cap;
+    }
+
+    w->stack[w->nstack].path = strdup(path);
+    if (!w->stack[w->nstack].path)
+        return -1;
+
+    w->stack[w->nstack++].depth = depth;
+
+    return 0;
+}
+
+/* opens the next pending directory, returns false if there is none */
+static bool walk_open_next(struct eco_file_walk *w)
+{
+    while (w->nstack > 0) {
+        struct walk_pending *p = &w->stack[--w->nstack];
+
+        w->fd = open(p->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (w->fd >= 0) {
+            w->pathlen = strlen(p->path);
+            memcpy(w->path, p->path, w->pathlen + 1);
+
+            /* avoid double slash when joining the names */
+            if (w->pathlen > 0 && w->path[w->pathlen - 1] == '/')
+                w->path[--w->pathlen] = '\0';
+
+            w->depth = p->depth;
+            w->bpos = w->blen = 0;
+        }
+
+        free(p->path);
+
+        if (w->fd >= 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void walk_close(struct eco_file_walk *w)
+{
+    if (w->fd > -1) {
+        close(w->fd);
+        w->fd = -1;
+    }
+
+    while (w->nstack > 0)
+        free(w->stack[--w->nstack].path);
+}
+
+/*
+ * Returns the next batch of at most n entries, or nil at the end. Each
+ * entry is a table with path, name, type and depth, plus the fields of
+ * file.stat if the walker is created with the stat option.
+ */
+static int lua_walk_next(lua_State *L)
+{
+    struct eco_file_walk *w = luaL_checkudata(L, 1, ECO_FILE_WALK_MT);
+    int n = luaL_optinteger(L, 2, 256);
+    int count = 0;
+
+    luaL_argcheck(L, n > 0, 2, "must be greater than 0");
+
+    lua_createtable(L, n, 0);
+
+    while (count < n) {
+        struct linux_dirent64 *d;
+        unsigned char type;
+        bool descend, wanted;
+        struct stat st;
+        size_t namelen;
+
+        if (w->fd < 0 && !walk_open_next(w))
+            break;
+
+        if (w->bpos >= w->blen) {
+            w->blen = syscall(SYS_getdents64, w->fd, w->buf, ECO_FILE_WALK_BUF);
+            if (w->blen <= 0) {
+                close(w->fd);
+                w->fd = -1;
+                continue;
+            }
+            w->bpos = 0;
+        }
+
+        d = (struct linux_dirent64 *)(w->buf + w->bpos);
+        w->bpos += d->d_reclen;
+
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+            continue;
+
+        namelen = strlen(d->d_name);
+        if (w->pathlen + 1 + namelen >= PATH_MAX)
+            continue;
+
+        if (w->exclude && !fnmatch(w->exclude, d->d_name, 0))
+            continue;
+
+        type = d->d_type;
+
+        if (type == DT_UNKNOWN || w->stat) {
+            if (fstatat(w->fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+                continue;
+            type = walk_mode_to_type(st.st_mode);
+        }
+
+        /* the directories are descended regardless of the filters */
+        descend = type == DT_DIR && (w->max_depth < 1 || w->depth < w->max_depth);
+        wanted = (!w->types || (w->types & (1 << type))) &&
+                (!w->match || !fnmatch(w->match, d->d_name, 0));
+
+        if (!descend && !wanted)
+            continue;
+
+        w->path[w->pathlen] = '/';
+        memcpy(w->path + w->pathlen + 1, d->d_name, namelen + 1);
+
+        if (descend && walk_push(w, w->path, w->depth + 1)) {
+            w->path[w->pathlen] = '\0';
+            return luaL_error(L, "no mem");
+        }
+
+        if (!wanted) {
+            w->path[w->pathlen] = '\0';
+            continue;
+        }
+
+        lua_createtable(L, 0, w->stat ? 16 : 4);
+
+        lua_pushlstring(L, w->path, w->pathlen + 1 + namelen);
+        lua_setfield(L, -2, "path");
+
+        lua_pushlstring(L, d->d_name, namelen);
+        lua_setfield(L, -2, "name");
+
+        lua_pushinteger(L, w->depth);
+        lua_setfield(L, -2, "depth");
+
+        if (w->stat) {
+            lua_file_stat_fields(L, &st);
+        } else {
+            lua_pushstring(L, walk_type_name(type));
+            lua_setfield(L, -2, "type");
+        }
+
+        lua_rawseti(L, -2, ++count);
+
+        w->path[w->pathlen] = '\0';
+    }
+
+    if (count == 0) {
+        walk_close(w);
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+static int lua_walk_close(lua_State *L)
+{
+    struct eco_file_walk *w = luaL_checkudata(L, 1, ECO_FILE_WALK_MT);
+
+    walk_close(w);
+
+    free(w->stack);
+    free(w->buf);
+    free(w->match);
+    free(w->exclude);
+
+    w->stack = NULL;
+    w->capstack = 0;
+    w->buf = NULL;
+    w->match = NULL;
+    w->exclude = NULL;
+
+    return 0;
+}
+
+static const struct luaL_Reg walk_methods[] =  {
+    {"next", lua_walk_next},
+    {"close", lua_walk_close},
+    {"__gc", lua_walk_close},
+    {NULL, NULL}
+};
+
+static const char *walk_types[] = {
+    "FIFO", "CHR", "DIR", "BLK", "REG", "LNK", "SOCK", NULL
+};
+
+static const unsigned char walk_type_values[] = {
+    DT_FIFO, DT_CHR, DT_DIR, DT_BLK, DT_REG, DT_LNK, DT_SOCK
+};
+
+static char *walk_opt_string(lua_State *L, const char *name)
+{
+    const char *s;
+
+    lua_getfield(L, 2, name);
+    s = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    return s ? strdup(s) : NULL;
+}
+
+/*
+ * Creates a walker of the directory tree, which reads the directories by
+ * getdents64 in large batches. The optional table opts supports:
+ * max_depth: the entries of root have depth 1, 0 means no limit
+ * types: a list of the types to return, e.g. { 'REG' }
+ * match: a shell wildcard pattern the names to return must match
+ * exclude: a shell wildcard pattern of the names to skip, the excluded
+ *          directories are not descended
+ * stat: a boolean flag controls whether to include the fields of file.stat
+ * The symbolic links are never followed.
+ */
+static int lua_file_walk(lua_State *L)
+{
+    const char *root = luaL_checkstring(L, 1);
+    struct eco_file_walk *w;
+
+    w = lua_newuserdata(L, sizeof(struct eco_file_walk));
+    memset(w, 0, sizeof(struct eco_file_walk));
+    w->fd = -1;
+    luaL_setmetatable(L, ECO_FILE_WALK_MT);
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "max_depth");
+        w->max_depth = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "stat");
+        w->stat = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "types");
+        if (lua_istable(L, -1)) {
+            int i, n = lua_rawlen(L, -1);
+
+            for (i = 1; i <= n; i++) {
+                const char *name;
+                int t;
+
+                lua_rawgeti(L, -1, i);
+                name = lua_tostring(L, -1);
+
+                for (t = 0; walk_types[t]; t++) {
+                    if (name && !strcmp(name, walk_types[t]))
+                        break;
+                }
+
+                if (!walk_types[t])
+                    return luaL_argerror(L, 2, "invalid type in types");
+
+                w->types |= 1 << walk_type_values[t];
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+
+        w->match = walk_opt_string(L, "match");
+        w->exclude = walk_opt_string(L, "exclude");
+    }
+
+    w->buf = malloc(ECO_FILE_WALK_BUF);
+    if (!w->buf || walk_push(w, root, 1))
+        return luaL_error(L, "no mem");
+
+    if (!walk_open_next(w)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    return 1;
+}
+
+static int lua_file_chown(lua_State *L)
+{
+    const char *pathname = luaL_checkstring(L, 1);
+    uid_t uid = -1;
+    gid_t gid = -1;
+
+    if (lua_isnumber(L, 2))
+        uid = (uid_t)lua_tointeger(L, 2);
+
+    if (lua_isnumber(L, 3))
+        gid = (gid_t)lua_tointeger(L, 3);
+
+    if (chown(pathname, uid, gid)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+
+    return 1;
+}
+
+/*
+ * Declares the access pattern of the range of the file, the advice is one of
+ * 'normal', 'sequential', 'random', 'willneed', 'dontneed' and 'noreuse'.
+ * The offset and len default to 0, which means to the end of the file.
+ */
+static int lua_file_fadvise(lua_State *L)
+{
+    static const char *const names[] = {
+        "normal", "sequential", "random", "willneed", "dontneed", "noreuse", NULL
+    };
+    static const int advices[] = {
+        POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+        POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED, POSIX_FADV_NOREUSE
+    };
+    int fd = luaL_checkinteger(L, 1);
+    int advice = advices[luaL_checkoption(L, 2, NULL, names)];
+    off_t offset = luaL_optinteger(L, 3, 0);
+    off_t len = luaL_optinteger(L, 4, 0);
+    int err;
+
+    err = posix_fadvise(fd, offset, len, advice);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+
+    return 1;
+}
+
+/* creates a pipe, both ends are close-on-exec, and flags are ORed, e.g. O_NONBLOCK */
+static int lua_file_pipe(lua_State *L)
+{
+    int flags = luaL_optinteger(L, 1, 0);
+    int fds[2];
+
+    if (pipe2(fds, flags | O_CLOEXEC) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, fds[0]);
+    lua_pushinteger(L, fds[1]);
+
+    return 2;
+}
+
+/*
+ * Moves up to len bytes between two descriptors in the kernel without
+ * blocking on the pipe, one of them must be a pipe. It returns the bytes
+ * moved, 0 at the end of input.
+ */
+static int lua_file_splice(lua_State *L)
+{
+    int fd_in = luaL_checkinteger(L, 1);
+    int fd_out = luaL_checkinteger(L, 2);
+    size_t len = luaL_optinteger(L, 3, 65536);
+    ssize_t ret;
+
+again:
+    ret = splice(fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret < 0) {
+        if (errno == EINTR)
+            goto again;
+        lua_pushnil(L);
+        if (errno == EPIPE)
+            lua_pushliteral(L, "closed");
+        else
+            lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int lua_file_chmod(lua_State *L)
+{
+    const char *pathname = luaL_checkstring(L, 1);
+    mode_t mode = luaL_checkinteger(L, 2);
+
+    if (chmod(pathname, mode)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+
+    return 1;
+}
+
+static int lua_file_dirname(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    char *buf = strdup(path);
+
+    lua_pushstring(L, dirname(buf));
+    free(buf);
+
+    return 1;
+}
+
+static int lua_file_basename(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    char *buf = strdup(path);
+
+    lua_pushstring(L, basename(buf));
+    free(buf);
+
+    return 1;
+}
+
+static int lua_file_flock(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    int operation = luaL_checkinteger(L, 2);
+
+    if (flock(fd, operation | LOCK_NB)) {
+        lua_pushnil(L);
+        lua_pushinteger(L, errno);
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+
+    return 1;
+}
+
+static ssize_t aio_readdir(struct eco_file_aio *req)
+{
+    size_t cap = ECO_FILE_AIO_READDIR_BUF;
+    struct dirent *e;
+    size_t len = 0;
+    DIR *d;
+
+    d = opendir(req->path);
+    if (!d)
+        return -1;
+
+    req->buf = malloc(cap);
+    if (!req->buf)
+        goto err;
+
+    /* the names are stored in buf, each terminated by '\0' */
+    while ((e = readdir(d))) {
+        size_t n = strlen(e->d_name) + 1;
+
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+
+        if (len + n > cap) {
+            void *buf;
+
+            while (len + n > cap)
+                cap *= 2;
+
+            buf = realloc(req->buf, cap);
+            if (!buf)
+                goto err;
+
+            req->buf = buf;
+        }
+
+        memcpy((char *)req->buf + len, e->d_name, n);
+        len += n;
+    }
+
+    closedir(d);
+
+    return len;
+
+err:
+    closedir(d);
+    errno = ENOMEM;
+    return -1;
+}
+
+static ssize_t copy_read_write(struct eco_file_aio *req, size_t n)
+{
+    ssize_t ret, written = 0;
+
+    if (!req->buf && posix_memalign(&req->buf, ECO_FILE_AIO_ALIGN, ECO_FILE_AIO_COPY_BUF)) {
+        req->buf = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (n > ECO_FILE_AIO_COPY_BUF)
+        n = ECO_FILE_AIO_COPY_BUF;
+
+    do {
+        ret = read(req->fd, req->buf, n);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+        return ret;
+
+    while (written < ret) {
+        ssize_t w = write(req->outfd, (char *)req->buf + written, ret - written);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += w;
+    }
+
+    return ret;
+}
+
+/*
+ * Copies up to len bytes from the current offset of fd to outfd, and returns
+ * the number of bytes copied, which is less than len only at the end of file.
+ * The method used is stored in flags, which is the one to try first.
+ */
+static ssize_t aio_copy(struct eco_file_aio *req)
+{
+    size_t copied = 0;
+
+    while (copied < req->len) {
+        size_t n = req->len - copied;
+        ssize_t ret;
+
+        switch (req->flags) {
+        case COPY_FILE_RANGE:
+#ifdef SYS_copy_file_range
+            ret = syscall(SYS_copy_file_range, req->fd, NULL, req->outfd, NULL, n, 0);
+#else
+            ret = -1;
+            errno = ENOSYS;
+#endif
+            /*
+             * e.g. unsupported by the kernel or the filesystems, and some
+             * kernels return 0 for the special files like the ones in procfs
+             */
+            if (ret == 0 || (ret < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EPERM || errno == EBADF))) {
+                req->flags = COPY_SENDFILE;
+                continue;
+            }
+            break;
+
+        case COPY_SENDFILE:
+            ret = sendfile(req->outfd, req->fd, NULL, n);
+            if (ret < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                req->flags = COPY_READ_WRITE;
+                continue;
+            }
+            break;
+
+        default:
+            ret = copy_read_write(req, n);
+            break;
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (ret == 0)
+            break;
+
+        copied += ret;
+    }
+
+    return copied;
+}
+
+/* writes all the buffers, retries the partial writes */
+static ssize_t aio_writev(struct eco_file_aio *req)
+{
+    struct iovec *iov = req->iov;
+    int iovcnt = req->iovcnt;
+    size_t total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t ret = writev(req->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        total += ret;
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return total;
+}
+
+static void aio_execute(struct eco_file_aio *req)
+{
+    ssize_t ret;
+
+again:
+    switch (req->op) {
+    case AIO_OPEN:
+        ret = open(req->path, req->flags, req->mode);
+        break;
+
+    case AIO_CLOSE:
+        ret = close(req->fd);
+        break;
+
+    case AIO_PREAD:
+        if (req->offset < 0)
+            ret = read(req->fd, req->buf, req->len);
+        else
+            ret = pread(req->fd, req->buf, req->len, req->offset);
+        break;
+
+    case AIO_PWRITE:
+        if (req->offset < 0)
+            ret = write(req->fd, req->data, req->len);
+        else
+            ret = pwrite(req->fd, req->data, req->len, req->offset);
+        break;
+
+    case AIO_FSYNC:
+        ret = fsync(req->fd);
+        break;
+
+    case AIO_FDATASYNC:
+        ret = fdatasync(req->fd);
+        break;
+
+    case AIO_STAT:
+        ret = stat(req->path, &req->st);
+        break;
+
+    case AIO_READDIR:
+        ret = aio_readdir(req);
+        break;
+
+    case AIO_RENAME:
+        ret = rename(req->path, req->newpath);
+        break;
+
+    case AIO_UNLINK:
+        ret = unlink(req->path);
+        break;
+
+    case AIO_COPY:
+        ret = aio_copy(req);
+        break;
+
+    case AIO_WRITEV:
+        ret = aio_writev(req);
+        break;
+
+    case AIO_SYNC:
+        sync();
+        ret = 0;
+        break;
+
+    case AIO_READAHEAD:
+        ret = readahead(req->fd, req->offset, req->len);
+        break;
+
+    default:
+        ret = -1;
+        errno = EINVAL;
+        break;
+    }
+
+    if (ret < 0 && errno == EINTR && req->op != AIO_CLOSE)
+        goto again;
+
+    req->ret = ret;
+    req->err = errno;
+}
+
+static void *aio_worker(void *arg)
+{
+    struct eco_file_aio *req;
+
+    while (true) {
+        pthread_mutex_lock(&aio_pool.lock);
+
+        while (!aio_pool.head) {
+            aio_pool.idle++;
+            pthread_cond_wait(&aio_pool.cond, &aio_pool.lock);
+            aio_pool.idle--;
+        }
+
+        req = aio_pool.head;
+        aio_pool.head = req->next;
+        if (!aio_pool.head)
+            aio_pool.tail = NULL;
+
+        pthread_mutex_unlock(&aio_pool.lock);
+
+        aio_execute(req);
+
+        pthread_mutex_lock(&aio_pool.lock);
+        req->next = aio_pool.done;
+        aio_pool.done = req;
+        pthread_mutex_unlock(&aio_pool.lock);
+
+        ev_async_send(aio_pool.eco->loop, &aio_pool.async);
+    }
+
+    return NULL;
+}
+
+/* the signals are left to the event loop thread */
+static int aio_spawn_worker()
+{
+    sigset_t set, oldset;
+    pthread_t tid;
+    int err;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+    err = pthread_create(&tid, NULL, aio_worker, NULL);
+    if (!err)
+        pthread_detach(tid);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return err;
+}
+
+static void aio_done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct eco_file_aio *req, *next;
+
+    pthread_mutex_lock(&aio_pool.lock);
+    req = aio_pool.done;
+    aio_pool.done = NULL;
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    for (; req; req = next) {
+        next = req->next;
+
+        if (--aio_pool.pending == 0)
+            ev_async_stop(loop, w);
+
+        eco_resume(aio_pool.eco->L, req->co, 0);
+    }
+}
+
+static int lua_aio_k(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_file_aio *req = (struct eco_file_aio *)ctx;
+    int nret = 1;
+
+    if (req->ret < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(req->err));
+        nret = 2;
+        goto done;
+    }
+
+    switch (req->op) {
+    case AIO_OPEN:
+    case AIO_PWRITE:
+    case AIO_WRITEV:
+        lua_pushinteger(L, req->ret);
+        break;
+
+    case AIO_PREAD:
+        lua_pushlstring(L, req->buf, req->ret);
+        break;
+
+    case AIO_COPY:
+        lua_pushinteger(L, req->ret);
+        lua_pushinteger(L, req->flags);
+        nret = 2;
+        break;
+
+    case AIO_STAT:
+        __lua_file_stat(L, &req->st);
+        break;
+
+    case AIO_READDIR: {
+        const char *name = req->buf;
+        const char *end = name + req->ret;
+        int i = 1;
+
+        lua_newtable(L);
+
+        while (name < end) {
+            size_t n = strlen(name);
+
+            lua_pushlstring(L, name, n);
+            lua_rawseti(L, -2, i++);
+            name += n + 1;
+        }
+        break;
+    }
+
+    default:
+        lua_pushboolean(L, true);
+        break;
+    }
+
+done:
+    free(req->iov);
+    free(req->buf);
+    free(req);
+
+    return nret;
+}
+
+static void aio_atfork_prepare(void)
+{
+    pthread_mutex_lock(&aio_pool.lock);
+}
+
+static void aio_atfork_parent(void)
+{
+    pthread_mutex_unlock(&aio_pool.lock);
+}
+
+/*
+ * The child has none of the workers, so the pool starts over, and the
+ * requests of the parent are never completed in the child.
+ */
+static void aio_atfork_child(void)
+{
+    struct eco_file_aio *req, *next;
+
+    for (req = aio_pool.head; req; req = next) {
+        next = req->next;
+        free(req->iov);
+        free(req->buf);
+        free(req);
+    }
+
+    for (req = aio_pool.done; req; req = next) {
+        next = req->next;
+        free(req->iov);
+        free(req->buf);
+        free(req);
+    }
+
+    if (aio_pool.eco && aio_pool.pending)
+        ev_async_stop(aio_pool.eco->loop, &aio_pool.async);
+
+    pthread_mutex_init(&aio_pool.lock, NULL);
+    pthread_cond_init(&aio_pool.cond, NULL);
+
+    aio_pool.head = NULL;
+    aio_pool.tail = NULL;
+    aio_pool.done = NULL;
+    aio_pool.eco = NULL;
+    aio_pool.nthreads = 0;
+    aio_pool.idle = 0;
+    aio_pool.pending = 0;
+}
+
+static int aio_submit(lua_State *L, struct eco_file_aio *req)
+{
+    static bool registered;
+    int err = 0;
+
+    if (!registered) {
+        pthread_atfork(aio_atfork_prepare, aio_atfork_parent, aio_atfork_child);
+        registered = true;
+    }
+
+    if (!aio_pool.eco) {
+        aio_pool.eco = eco_get_context(L);
+        ev_async_init(&aio_pool.async, aio_done_cb);
+    }
+
+    pthread_mutex_lock(&aio_pool.lock);
+
+    if (aio_pool.idle == 0 && aio_pool.nthreads < ECO_FILE_AIO_MAX_THREADS) {
+        err = aio_spawn_worker();
+        if (!err)
+            aio_pool.nthreads++;
+    }
+
+    if (aio_pool.nthreads == 0) {
+        pthread_mutex_unlock(&aio_pool.lock);
+        free(req->buf);
+        free(req);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+
+    req->co = L;
+    req->next = NULL;
+
+    /* must be started before the request is visible to the workers */
+    if (aio_pool.pending++ == 0)
+        ev_async_start(aio_pool.eco->loop, &aio_pool.async);
+
+    if (aio_pool.tail)
+        aio_pool.tail->next = req;
+    else
+        aio_pool.head = req;
+    aio_pool.tail = req;
+
+    pthread_cond_signal(&aio_pool.cond);
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    return lua_yieldk(L, 0, (lua_KContext)req, lua_aio_k);
+}
+
+static struct eco_file_aio *aio_new(lua_State *L, int op)
+{
+    struct eco_file_aio *req = calloc(1, sizeof(struct eco_file_aio));
+
+    if (!req)
+        luaL_error(L, "no mem");
+
+    req->op = op;
+
+    return req;
+}
+
+static int lua_aio_open(lua_State *L)
+{
+    const char *pathname = luaL_checkstring(L, 1);
+    int flags = luaL_optinteger(L, 2, 0);
+    int mode = luaL_optinteger(L, 3, 0);
+    struct eco_file_aio *req = aio_new(L, AIO_OPEN);
+
+    req->path = pathname;
+    req->flags = flags;
+    req->mode = mode;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_close(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_CLOSE);
+
+    req->fd = fd;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_pread(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    lua_Integer offset = luaL_optinteger(L, 3, -1);
+    struct eco_file_aio *req;
+
+    luaL_argcheck(L, n > 0, 2, "must be greater than 0");
+
+    req = aio_new(L, AIO_PREAD);
+
+    if (posix_memalign(&req->buf, ECO_FILE_AIO_ALIGN, n)) {
+        free(req);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOMEM));
+        return 2;
+    }
+
+    req->fd = fd;
+    req->len = n;
+    req->offset = offset;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_pwrite(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    lua_Integer offset = luaL_optinteger(L, 3, -1);
+    struct eco_file_aio *req = aio_new(L, AIO_PWRITE);
+
+    req->fd = fd;
+    req->data = data;
+    req->len = len;
+    req->offset = offset;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_fsync(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_FSYNC);
+
+    req->fd = fd;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_fdatasync(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_FDATASYNC);
+
+    req->fd = fd;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_sync(lua_State *L)
+{
+    return aio_submit(L, aio_new(L, AIO_SYNC));
+}
+
+/* populates the page cache with the range of the file, which blocks until the data is read */
+static int lua_aio_readahead(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+    struct eco_file_aio *req = aio_new(L, AIO_READAHEAD);
+
+    req->fd = fd;
+    req->offset = offset;
+    req->len = count;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_stat(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_STAT);
+
+    req->path = path;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_readdir(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_READDIR);
+
+    req->path = path;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_rename(lua_State *L)
+{
+    const char *oldpath = luaL_checkstring(L, 1);
+    const char *newpath = luaL_checkstring(L, 2);
+    struct eco_file_aio *req = aio_new(L, AIO_RENAME);
+
+    req->path = oldpath;
+    req->newpath = newpath;
+
+    return aio_submit(L, req);
+}
+
+static int lua_aio_unlink(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    struct eco_file_aio *req = aio_new(L, AIO_UNLINK);
+
+    req->path = path;
+
+    return aio_submit(L, req);
+}
+
+/*
+ * Copies up to n bytes between the current offsets of two files, returns the
+ * number of bytes copied, 0 at the end of file, and the method used, which
+ * should be passed on the next call to skip the unsupported ones.
+ */
+static int lua_aio_copy(lua_State *L)
+{
+    int infd = luaL_checkinteger(L, 1);
+    int outfd = luaL_checkinteger(L, 2);
+    lua_Integer n = luaL_checkinteger(L, 3);
+    int method = luaL_optinteger(L, 4, COPY_FILE_RANGE);
+    struct eco_file_aio *req;
+
+    luaL_argcheck(L, n > 0, 3, "must be greater than 0");
+
+    req = aio_new(L, AIO_COPY);
+
+    req->fd = infd;
+    req->outfd = outfd;
+    req->len = n;
+    req->flags = method;
+
+    return aio_submit(L, req);
+}
+
+/*
+ * Writes a list of strings by writev at the current offset, returns the
+ * number of bytes written, which is the total size unless error occurs.
+ * The list must not be modified until it returns.
+ */
+static int lua_aio_writev(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    struct eco_file_aio *req;
+    int i, n;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    n = lua_rawlen(L, 2);
+
+    req = aio_new(L, AIO_WRITEV);
+
+    req->iov = malloc(sizeof(struct iovec) * (n ? n : 1));
+    if (!req->iov) {
+        free(req);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t len;
+
+        /* the strings are kept alive by the list */
+        if (lua_rawgeti(L, 2, i + 1) != LUA_TSTRING) {
+            free(req->iov);
+            free(req);
+            return luaL_argerror(L, 2, "must be a list of strings");
+        }
+
+        req->iov[i].iov_base = (void *)lua_tolstring(L, -1, &len);
+        req->iov[i].iov_len = len;
+
+        lua_pop(L, 1);
+    }
+
+    req->fd = fd;
+    req->iovcnt = n;
+
+    return aio_submit(L, req);
+}
+
+static const luaL_Reg aio_funcs[] = {
+    {"open", lua_aio_open},
+    {"close", lua_aio_close},
+    {"pread", lua_aio_pread},
+    {"pwrite", lua_aio_pwrite},
+    {"fsync", lua_aio_fsync},
+    {"fdatasync", lua_aio_fdatasync},
+    {"sync", lua_aio_sync},
+    {"readahead", lua_aio_readahead},
+    {"stat", lua_aio_stat},
+    {"readdir", lua_aio_readdir},
+    {"rename", lua_aio_rename},
+    {"unlink", lua_aio_unlink},
+    {"copy", lua_aio_copy},
+    {"writev", lua_aio_writev},
+    {NULL, NULL}
+};
+
+/*
+ * A contended lock is waited by a blocking flock on a dedicated thread, since
+ * the wait may be long. The thread is interrupted by a signal on timeout.
+ */
+struct eco_file_lock {
+    struct eco_context *eco;
+    struct ev_async async;
+    struct ev_timer tmr;
+    pthread_t tid;
+    lua_State *co;
+    int fd;
+    int op;
+    int ret;
+    int err;
+    volatile sig_atomic_t canceled;
+    bool timedout;
+};
+
+/* the real-time signal to interrupt the blocking flock on timeout, 0 if none is free */
+static int lock_signal = -1;
+
+static void lock_signal_handler(int sig)
+{
+}
+
+/*
+ * Picks a real-time signal without a handler, so the handler installed by
+ * others is never replaced.
+ */
+static int lock_signal_init(void)
+{
+    struct sigaction sa = {
+        .sa_handler = lock_signal_handler
+    };
+    int sig;
+
+    if (lock_signal >= 0)
+        return lock_signal;
+
+    lock_signal = 0;
+
+    /* without SA_RESTART, so the flock is interrupted by it */
+    sigemptyset(&sa.sa_mask);
+
+    for (sig = SIGRTMIN + 1; sig <= SIGRTMAX; sig++) {
+        struct sigaction old;
+
+        if (sigaction(sig, NULL, &old))
+            continue;
+
+        if ((old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL)
+            continue;
+
+        if (!sigaction(sig, &sa, NULL)) {
+            lock_signal = sig;
+            break;
+        }
+    }
+
+    return lock_signal;
+}
+
+static void *lock_worker(void *arg)
+{
+    struct eco_file_lock *lk = arg;
+
+    if (lk->canceled) {
+        lk->ret = -1;
+        lk->err = EINTR;
+    } else {
+        lk->ret = flock(lk->fd, lk->op);
+        lk->err = errno;
+    }
+
+    ev_async_send(lk->eco->loop, &lk->async);
+
+    return NULL;
+}
+
+static void lock_done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct eco_file_lock *lk = container_of(w, struct eco_file_lock, async);
+
+    ev_async_stop(loop, w);
+    ev_timer_stop(loop, &lk->tmr);
+
+    pthread_join(lk->tid, NULL);
+
+    eco_resume(lk->eco->L, lk->co, 0);
+}
+
+/* interrupts the flock, and again until the thread finished in case it isn't in flock yet */
+static void lock_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    struct eco_file_lock *lk = container_of(w, struct eco_file_lock, tmr);
+
+    lk->timedout = true;
+    lk->canceled = 1;
+
+    pthread_kill(lk->tid, lock_signal);
+
+    ev_timer_set(w, 0.01, 0);
+    ev_timer_start(loop, w);
+}
+
+static int lua_flock_waitk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_file_lock *lk = (struct eco_file_lock *)ctx;
+    int nret = 1;
+
+    /*
+     * The lock may be acquired right after timeout, it's kept and reported
+     * as acquired. Unlocking it would leave the file unlocked, even if the
+     * caller held a lock of the other mode before.
+     */
+    if (lk->ret == 0) {
+        lua_pushboolean(L, true);
+    } else if (lk->timedout) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        nret = 2;
+    } else {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(lk->err));
+        nret = 2;
+    }
+
+    close(lk->fd);
+    free(lk);
+
+    return nret;
+}
+
+/*
+ * Applies the lock like flock, waits without polling if the lock is
+ * contended. The optional timeout is in seconds, it fails if no real-time
+ * signal is free to interrupt the wait.
+ */
+static int lua_file_flock_wait(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    int operation = luaL_checkinteger(L, 2);
+    double timeout = luaL_optnumber(L, 3, 0);
+    struct eco_file_lock *lk;
+    sigset_t set, oldset;
+    int err;
+
+    if (!flock(fd, operation | LOCK_NB)) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    if (errno != EWOULDBLOCK)
+        goto err;
+
+    if (timeout > 0 && !lock_signal_init()) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no free signal to interrupt the wait");
+        return 2;
+    }
+
+    lk = calloc(1, sizeof(struct eco_file_lock));
+    if (!lk)
+        goto err;
+
+    /* the lock is held by the open file description, which is shared by the dup */
+    lk->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (lk->fd < 0) {
+        free(lk);
+        goto err;
+    }
+
+    lk->eco = eco_get_context(L);
+    lk->co = L;
+    lk->op = operation & ~LOCK_NB;
+
+    ev_async_init(&lk->async, lock_done_cb);
+    ev_async_start(lk->eco->loop, &lk->async);
+
+    ev_init(&lk->tmr, lock_timeout_cb);
+
+    sigfillset(&set);
+    if (lock_signal > 0)
+        sigdelset(&set, lock_signal);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+    err = pthread_create(&lk->tid, NULL, lock_worker, lk);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err) {
+        ev_async_stop(lk->eco->loop, &lk->async);
+        close(lk->fd);
+        free(lk);
+        errno = err;
+        goto err;
+    }
+
+    if (timeout > 0) {
+        ev_timer_set(&lk->tmr, timeout, 0);
+        ev_timer_start(lk->eco->loop, &lk->tmr);
+    }
+
+    return lua_yieldk(L, 0, (lua_KContext)lk, lua_flock_waitk);
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+}
+
+static const luaL_Reg funcs[] = {
+    {"open", lua_file_open},
+    {"close", lua_file_close},
+    {"read", lua_file_read},
+    {"write", lua_file_write},
+    {"lseek", lua_file_lseek},
+    {"access", lua_file_access},
+    {"readlink", lua_readlink},
+    {"stat", lua_file_stat},
+    {"fstat", lua_file_fstat},
+    {"statvfs", lua_file_statvfs},
+    {"chown", lua_file_chown},
+    {"chmod", lua_file_chmod},
+    {"fadvise", lua_file_fadvise},
+    {"pipe", lua_file_pipe},
+    {"splice", lua_file_splice},
+    {"dirname", lua_file_dirname},
+    {"basename", lua_file_basename},
+    {"flock", lua_file_flock},
+    {"flock_wait", lua_file_flock_wait},
+    {"mmap", lua_file_mmap},
+    {"walk", lua_file_walk},
+    {NULL, NULL}
+};
+
+int luaopen_eco_core_file(lua_State *L)
+{
+    luaL_newlib(L, funcs);
+
+    lua_add_constant(L, "O_RDONLY", O_RDONLY);
+    lua_add_constant(L, "O_WRONLY", O_WRONLY);
+    lua_add_constant(L, "O_RDWR", O_RDWR);
+
+    lua_add_constant(L, "O_APPEND", O_APPEND);
+    lua_add_constant(L, "O_CLOEXEC", O_CLOEXEC);
+    lua_add_constant(L, "O_CREAT", O_CREAT);
+    lua_add_constant(L, "O_EXCL", O_EXCL);
+    lua_add_constant(L, "O_NOCTTY", O_NOCTTY);
+    lua_add_constant(L, "O_NONBLOCK", O_NONBLOCK);
+    lua_add_constant(L, "O_TRUNC", O_TRUNC);
+    lua_add_constant(L, "O_DIRECT", O_DIRECT);
+
+    lua_add_constant(L, "S_IRWXU", S_IRWXU);
+    lua_add_constant(L, "S_IRUSR", S_IRUSR);
+    lua_add_constant(L, "S_IWUSR", S_IWUSR);
+    lua_add_constant(L, "S_IXUSR", S_IXUSR);
+    lua_add_constant(L, "S_IRWXG", S_IRWXG);
+    lua_add_constant(L, "S_IRGRP", S_IRGRP);
+    lua_add_constant(L, "S_IWGRP", S_IWGRP);
+    lua_add_constant(L, "S_IXGRP", S_IXGRP);
+    lua_add_constant(L, "S_IRWXO", S_IRWXO);
+    lua_add_constant(L, "S_IROTH", S_IROTH);
+    lua_add_constant(L, "S_IWOTH", S_IWOTH);
+    lua_add_constant(L, "S_IXOTH", S_IXOTH);
+    lua_add_constant(L, "S_ISUID", S_ISUID);
+    lua_add_constant(L, "S_ISGID", S_ISGID);
+    lua_add_constant(L, "S_ISVTX", S_ISVTX);
+
+    lua_add_constant(L, "SEEK_SET", SEEK_SET);
+    lua_add_constant(L, "SEEK_CUR", SEEK_CUR);
+    lua_add_constant(L, "SEEK_END", SEEK_END);
+
+    lua_add_constant(L, "LOCK_SH", LOCK_SH);
+    lua_add_constant(L, "LOCK_EX", LOCK_EX);
+    lua_add_constant(L, "LOCK_UN", LOCK_UN);
+
+    eco_new_metatable(L, ECO_FILE_DIR_MT, dir_methods);
+    lua_pushcclosure(L, lua_file_dir, 1);
+    lua_setfield(L, -2, "dir");
+
+    luaL_newlib(L, aio_funcs);
+    lua_add_constant(L, "COPY_FILE_RANGE", COPY_FILE_RANGE);
+    lua_add_constant(L, "COPY_SENDFILE", COPY_SENDFILE);
+    lua_add_constant(L, "COPY_READ_WRITE", COPY_READ_WRITE);
+    lua_setfield(L, -2, "aio");
+
+    eco_new_metatable(L, ECO_FILE_MMAP_MT, mmap_methods);
+    lua_pop(L, 1);
+
+    eco_new_metatable(L, ECO_FILE_WALK_MT, walk_methods);
+    lua_pop(L, 1);
 
     return 1;
 }
@@ -4,18 +4,61 @@
 local file = require 'eco.core.file'
 local sys = require 'eco.core.sys'
 local bufio = require 'eco.bufio'
-local time = require 'eco.time'
+local sync = require 'eco.sync'
 
 local M = {}
 
+local aio = file.aio
+
+local READ_CHUNK = 65536
+
+local function readall(fd)
+    local chunks = {}
+
+    while true do
+        local data, err = aio.pread(fd, READ_CHUNK)
+        if not data then
+            return nil, err
+        end
+
+        if #data == 0 then
+            break
+        end
+
+        chunks[#chunks + 1] = data
+    end
+
+    return table.concat(chunks)
+end
+
+--[[
+    Reads the whole file by the worker pool, so the event loop isn't blocked.
+    The formats other than '*a' of io.read are read by the blocking io library.
+--]]
 function M.readfile(path, m)
-    local f, err = io.open(path, 'r')
-    if not f then
+    if m and m ~= '*a' and m ~= 'a' then
+        local f, err = io.open(path, 'r')
+        if not f then
+            return nil, err
+        end
+
+        local data, err = f:read(m)
+        f:close()
+
+        if not data then
+            return nil, err
+        end
+
+        return data
+    end
+
+    local fd, err = aio.open(path, file.O_RDONLY | file.O_CLOEXEC)
+    if not fd then
         return nil, err
     end
 
-    local data, err = f:read(m or '*a')
-    f:close()
+    local data, err = readall(fd)
+    aio.close(fd)
 
     if not data then
         return nil, err
@@ -25,60 +68,472 @@ function M.readfile(path, m)
 end
 
 function M.writefile(path, data, append)
-    local m = 'w'
+    local flags = file.O_WRONLY | file.O_CREAT | file.O_CLOEXEC
 
     if append then
-        m = 'a'
+        flags = flags | file.O_APPEND
+    else
+        flags = flags | file.O_TRUNC
     end
 
-    local f, err = io.open(path, m)
-    if not f then
+    local fd, err = aio.open(path, flags, 438) -- 0666, masked by umask
+    if not fd then
         return nil, err
     end
 
-    local n, err = f:write(data)
-    f:close()
+    local total = #data
+    local written = 0
+
+    while written < total do
+        local n, err = aio.pwrite(fd, written > 0 and data:sub(written + 1) or data)
+        if not n then
+            aio.close(fd)
+            return nil, err
+        end
+
+        written = written + n
+    end
 
-    if not n then
+    local ok, err = aio.close(fd)
+    if not ok then
         return nil, err
     end
-    return n
+
+    return total
 end
 
-function M.flock(fd, operation, timeout)
-    local deadtime
+local COPY_CHUNK = 8 * 1024 * 1024
+
+local copy_seq = 0
+
+-- makes the entries of the directory durable, e.g. after a rename
+local function sync_dir(path)
+    local fd = aio.open(path, file.O_RDONLY | file.O_CLOEXEC)
+    if fd then
+        aio.fsync(fd)
+        aio.close(fd)
+    end
+end
+
+--[[
+    Copies the regular file src to dst by the worker pool, the permission
+    bits of src are preserved, but not the setuid, setgid and sticky bits.
+    It tries copy_file_range, sendfile and a read/write loop in turn.
+
+    The data is copied into a temporary file in the directory of dst, which
+    is renamed to dst on success, so an existing dst is replaced only by a
+    complete copy, and left untouched on failure. A symbolic link dst is
+    replaced rather than followed.
+
+    opts is an optional Table that supports the following fields:
+    fsync: a boolean flag controls whether to fsync dst and its directory before returning
+    progress: a function called with the bytes copied and the total size after each chunk
+    direct: a boolean flag controls whether to bypass the page cache, src is read with
+            O_DIRECT(or dropped from the cache if unsupported), and dst is dropped from
+            the cache after fsync
+
+    It returns the number of bytes copied, or nil with an error message.
+--]]
+function M.copy(src, dst, opts)
+    opts = opts or {}
+
+    local st, err = aio.stat(src)
+    if not st then
+        return nil, err
+    end
+
+    if st.type ~= 'REG' then
+        return nil, 'not a regular file'
+    end
 
-    if timeout then
-        deadtime = sys.uptime() + timeout
+    local dst_st = aio.stat(dst)
+    if dst_st and dst_st.ino == st.ino and dst_st.dev == st.dev then
+        return nil, 'same file'
     end
 
+    local flags = file.O_RDONLY | file.O_CLOEXEC
+    local method, drop_src, infd
+
+    if opts.direct then
+        infd = aio.open(src, flags | file.O_DIRECT)
+        if infd then
+            method = aio.COPY_READ_WRITE
+        else
+            drop_src = true
+        end
+    end
+
+    if not infd then
+        infd, err = aio.open(src, flags)
+        if not infd then
+            return nil, err
+        end
+
+        file.fadvise(infd, 'sequential')
+    end
+
+    copy_seq = copy_seq + 1
+
+    local tmp = string.format('%s.%d.%d.tmp', dst, sys.getpid(), copy_seq)
+
+    local outfd, err = aio.open(tmp, file.O_WRONLY | file.O_CREAT | file.O_EXCL | file.O_CLOEXEC, st.mode)
+    if not outfd then
+        aio.close(infd)
+        return nil, err
+    end
+
+    local copied = 0
+    local n
+
     while true do
-        local ok, errno = file.flock(fd, operation)
-        if ok then
-            return true
+        n, method = aio.copy(infd, outfd, COPY_CHUNK, method)
+        if not n then
+            err = method
+            break
         end
 
-        if errno ~= sys.EAGAIN then
-            return false, sys.strerror(errno)
+        if n == 0 then
+            break
         end
 
-        if deadtime and sys.uptime() > deadtime then
-            return false, 'timeout'
+        copied = copied + n
+
+        if opts.progress then
+            local ok, perr = pcall(opts.progress, copied, st.size)
+            if not ok then
+                err = perr
+                break
+            end
+        end
+    end
+
+    if not err and opts.fsync then
+        _, err = aio.fsync(outfd)
+
+        if not err and opts.direct then
+            file.fadvise(outfd, 'dontneed')
         end
+    end
+
+    if drop_src then
+        file.fadvise(infd, 'dontneed')
+    end
+
+    aio.close(infd)
+
+    local ok, cerr = aio.close(outfd)
+    if not ok then
+        err = err or cerr
+    end
+
+    -- the mode passed to open is masked by umask
+    if not err then
+        _, err = file.chmod(tmp, st.mode)
+    end
+
+    if not err then
+        _, err = aio.rename(tmp, dst)
+    end
 
-        time.sleep(0.001)
+    if err then
+        aio.unlink(tmp)
+        return nil, err
+    end
+
+    if opts.fsync then
+        sync_dir(file.dirname(dst))
     end
+
+    return copied
 end
 
-function M.sync()
-    local pid, err = sys.exec('sync')
-    if not pid then
+--[[
+    Moves src to dst. It renames if they are on the same filesystem,
+    otherwise copies and then removes src. The opts is passed to file.copy.
+--]]
+function M.move(src, dst, opts)
+    local ok, err = aio.rename(src, dst)
+    if ok then
+        return true
+    end
+
+    if err ~= sys.strerror(sys.EXDEV) then
         return nil, err
     end
 
-    eco.watcher(eco.CHILD, pid):wait()
+    ok, err = M.copy(src, dst, opts)
+    if not ok then
+        return nil, err
+    end
+
+    ok, err = aio.unlink(src)
+    if not ok then
+        return nil, err
+    end
 
     return true
 end
 
+--[[
+    Walks the directory tree of root, see file.walk in C for the options.
+    It returns an iterator, which returns a batch of entries each time,
+    the size of the batch is opts.batch, defaults to 256.
+
+    for entries in file.walk('/var/log', { types = { 'REG' } }) do
+        for _, e in ipairs(entries) do
+            print(e.path, e.type)
+        end
+    end
+--]]
+function M.walk(root, opts)
+    local w, err = file.walk(root, opts)
+    if not w then
+        return nil, err
+    end
+
+    local n = opts and opts.batch or 256
+
+    return function()
+        return w:next(n)
+    end, w
+end
+
+--[[
+    Applies the lock(file.LOCK_SH or file.LOCK_EX) or removes it(file.LOCK_UN).
+    A contended lock is waited on a thread blocking in flock, without polling.
+    The optional timeout is in seconds.
+
+    As flock(2), converting a lock held on the fd, e.g. from shared to exclusive,
+    isn't atomic: the held lock is released first, so it's lost if the conversion
+    fails or times out.
+--]]
+function M.flock(fd, operation, timeout)
+    local ok, err = file.flock_wait(fd, operation, timeout)
+    if not ok then
+        return false, err
+    end
+
+    return true
+end
+
+-- commits the filesystem caches to disk
+function M.sync()
+    return aio.sync()
+end
+
+local appender_methods = {}
+
+-- the write is delayed unless someone is waiting for it
+local function appender_urgent(self)
+    return self.closed or self.pending_size >= self.max_buffer
+        or self.flush_target > self.written or self.sync_target > self.synced
+end
+
+local function appender_fail(self, err)
+    self.err = err
+    self.pending = {}
+    self.pending_size = 0
+    self.done:broadcast()
+end
+
+--[[
+    The flusher writes the buffered data in one writev, then fdatasyncs once
+    for all the sync requests arrived meanwhile, which is the group commit.
+    It runs only while there is work, so an idle appender holds no watcher.
+--]]
+local function appender_flusher(self)
+    while not self.err and (#self.pending > 0 or self.sync_target > self.synced) do
+        if #self.pending > 0 and self.delay > 0 and not appender_urgent(self) then
+            self.wake:wait(self.delay)
+        end
+
+        if #self.pending > 0 then
+            local batch, size = self.pending, self.pending_size
+
+            self.pending = {}
+            self.pending_size = 0
+
+            local n, err = aio.writev(self.fd, batch)
+            if not n then
+                appender_fail(self, err)
+                break
+            end
+
+            self.written = self.written + size
+            self.done:broadcast()
+        end
+
+        if self.sync_target > self.synced then
+            local target = self.written
+
+            local ok, err = aio.fdatasync(self.fd)
+            if not ok then
+                appender_fail(self, err)
+                break
+            end
+
+            self.synced = target
+            self.done:broadcast()
+        end
+    end
+
+    self.running = false
+    self.done:broadcast()
+end
+
+-- starts the flusher, or wakes it up from the delay
+local function appender_kick(self)
+    if self.running then
+        self.wake:broadcast()
+        return
+    end
+
+    self.running = true
+    eco.run(appender_flusher, self)
+end
+
+local function appender_wait(self, field, target)
+    while self[field] < target do
+        if self.err then
+            return nil, self.err
+        end
+        self.done:wait()
+    end
+
+    return true
+end
+
+--[[
+    Appends data to the buffer, it returns immediately unless the buffer
+    exceeds 4 times of max_buffer, in which case it waits for the flush.
+--]]
+function appender_methods:write(data)
+    if self.err then
+        return nil, self.err
+    end
+
+    if self.closed then
+        return nil, 'closed'
+    end
+
+    if #data == 0 then
+        return true
+    end
+
+    local pending = self.pending
+
+    pending[#pending + 1] = data
+
+    self.pending_size = self.pending_size + #data
+    self.appended = self.appended + #data
+
+    if not self.running or self.pending_size >= self.max_buffer then
+        appender_kick(self)
+    end
+
+    if self.pending_size >= self.max_buffer * 4 then
+        return self:flush()
+    end
+
+    return true
+end
+
+-- waits until all the data appended is written to the file
+function appender_methods:flush()
+    local target = self.appended
+
+    if self.err then
+        return nil, self.err
+    end
+
+    if self.written >= target then
+        return true
+    end
+
+    self.flush_target = math.max(self.flush_target, target)
+    appender_kick(self)
+
+    return appender_wait(self, 'written', target)
+end
+
+--[[
+    Waits until all the data appended is durable. The concurrent syncs are
+    committed by one fdatasync.
+--]]
+function appender_methods:sync()
+    local target = self.appended
+
+    if self.err then
+        return nil, self.err
+    end
+
+    if self.synced >= target then
+        return true
+    end
+
+    self.sync_target = math.max(self.sync_target, target)
+    appender_kick(self)
+
+    return appender_wait(self, 'synced', target)
+end
+
+--[[
+    Flushes the buffered data and closes the file. The file is closed after
+    the flusher exits, i.e. the pending syncs are done.
+--]]
+function appender_methods:close()
+    if self.closed then
+        return true
+    end
+
+    self.closed = true
+
+    local ok, err = self:flush()
+
+    while self.running do
+        self.done:wait()
+    end
+
+    aio.close(self.fd)
+
+    return ok, err
+end
+
+local appender_metatable = { __index = appender_methods }
+
+--[[
+    Creates a write-behind appender of the file, which buffers the writes and
+    appends them by writev in the background.
+
+    opts is an optional Table that supports the following fields:
+    mode: the mode to create the file, defaults to 0644
+    delay: the max seconds a write is buffered before written, defaults to 0.01
+    max_buffer: the buffered bytes to trigger the write immediately, defaults to 64K
+--]]
+function M.appender(path, opts)
+    opts = opts or {}
+
+    local fd, err = aio.open(path, file.O_WRONLY | file.O_CREAT | file.O_APPEND | file.O_CLOEXEC, opts.mode or 420)
+    if not fd then
+        return nil, err
+    end
+
+    local o = setmetatable({
+        fd = fd,
+        delay = opts.delay or 0.01,
+        max_buffer = opts.max_buffer or 64 * 1024,
+        pending = {},
+        pending_size = 0,
+        appended = 0,
+        written = 0,
+        synced = 0,
+        flush_target = 0,
+        sync_target = 0,
+        wake = sync.cond(),
+        done = sync.cond()
+    }, appender_metatable)
+
+    return o
+end
+
 return setmetatable(M, { __index = file })
@@ -0,0 +1,577 @@
+-- SPDX-License-Identifier: MIT
+-- Author: Jianhui Zhao <zhaojh329@gmail.com>
+
+local client = require 'eco.http.client'
+local socket = require 'eco.socket'
+local URL = require 'eco.http.url'
+local sync = require 'eco.sync'
+local time = require 'eco.time'
+local dns = require 'eco.dns'
+
+local concat = table.concat
+local tonumber = tonumber
+
+local M = {}
+
+--[[
+    A HDR (high dynamic range) histogram of integer values.
+    Values below 2^HIST_SUB_BITS are recorded exactly, larger values
+    are recorded with a relative error less than 1/2^(HIST_SUB_BITS - 1).
+--]]
+local HIST_SUB_BITS = 11
+local HIST_SUB_HALF = 1 << (HIST_SUB_BITS - 1)
+
+local function hist_index(v)
+    if v < (1 << HIST_SUB_BITS) then
+        return v
+    end
+
+    local bits = math.floor(math.log(v, 2)) + 1
+
+    if (1 << (bits - 1)) > v then
+        bits = bits - 1
+    elseif (1 << bits) <= v then
+        bits = bits + 1
+    end
+
+    local shift = bits - HIST_SUB_BITS
+
+    return (shift << (HIST_SUB_BITS - 1)) + (v >> shift)
+end
+
+-- returns the highest value equivalent to the bucket
+local function hist_value(idx)
+    if idx < (1 << HIST_SUB_BITS) then
+        return idx
+    end
+
+    local shift = idx // HIST_SUB_HALF - 1
+    local m = idx - shift * HIST_SUB_HALF
+
+    return ((m + 1) << shift) - 1
+end
+
+local hist_methods = {}
+
+function hist_methods:record(v)
+    v = math.floor(v)
+
+    if v < 0 then
+        v = 0
+    end
+
+    local idx = hist_index(v)
+    local counts = self.counts
+
+    counts[idx] = (counts[idx] or 0) + 1
+
+    self.total = self.total + 1
+    self.sum = self.sum + v
+    self.sumsq = self.sumsq + v * v
+
+    if not self.min or v < self.min then
+        self.min = v
+    end
+
+    if not self.max or v > self.max then
+        self.max = v
+    end
+end
+
+function hist_methods:count()
+    return self.total
+end
+
+function hist_methods:mean()
+    if self.total == 0 then
+        return 0
+    end
+
+    return self.sum / self.total
+end
+
+function hist_methods:stdev()
+    if self.total < 2 then
+        return 0
+    end
+
+    local mean = self:mean()
+    local var = self.sumsq / self.total - mean * mean
+
+    return var > 0 and math.sqrt(var) or 0
+end
+
+-- returns the value at the given percentile (0-100)
+function hist_methods:percentile(p)
+    if self.total == 0 then
+        return 0
+    end
+
+    local target = math.max(1, math.ceil(p / 100 * self.total))
+    local indexes = {}
+    local count = 0
+
+    for idx in pairs(self.counts) do
+        indexes[#indexes + 1] = idx
+    end
+
+    table.sort(indexes)
+
+    for _, idx in ipairs(indexes) do
+        count = count + self.counts[idx]
+        if count >= target then
+            return math.min(hist_value(idx), self.max)
+        end
+    end
+
+    return self.max
+end
+
+local hist_metatable = { __index = hist_methods }
+
+function M.histogram()
+    return setmetatable({ counts = {}, total = 0, sum = 0, sumsq = 0 }, hist_metatable)
+end
+
+local function build_request(ctx)
+    local data = {}
+
+    data[#data + 1] = string.format('%s %s HTTP/1.1\r\n', ctx.method, ctx.path)
+    data[#data + 1] = 'Host: ' .. ctx.host_header .. '\r\n'
+    data[#data + 1] = 'User-Agent: eco-bench/' .. eco.VERSION .. '\r\n'
+
+    for name, value in pairs(ctx.headers) do
+        data[#data + 1] = string.format('%s: %s\r\n', name, value)
+    end
+
+    if ctx.body then
+        data[#data + 1] = 'Content-Length: ' .. #ctx.body .. '\r\n'
+    end
+
+    data[#data + 1] = '\r\n'
+    data[#data + 1] = ctx.body
+
+    return concat(data)
+end
+
+local function read_response(sock, method, timeout)
+    local line, err = sock:recv('l', timeout)
+    if not line then
+        return nil, err
+    end
+
+    local code = line:match('^HTTP/%d%.%d +(%d+)')
+    if not code then
+        return nil, 'invalid http status line'
+    end
+
+    local length, chunked, close
+
+    while true do
+        line, err = sock:recv('l', timeout)
+        if not line then
+            return nil, err
+        end
+
+        if line == '\r' or line == '' then break end
+
+        local name, value = line:match('([%w%p]+) *: *([%w%p ]+)\r?$')
+        if name then
+            name = name:lower()
+            if name == 'content-length' then
+                length = tonumber(value)
+            elseif name == 'transfer-encoding' then
+                chunked = value:lower() == 'chunked'
+            elseif name == 'connection' then
+                close = value:lower() == 'close'
+            end
+        end
+    end
+
+    if method == 'HEAD' then
+        return tonumber(code), close
+    end
+
+    if chunked then
+        while true do
+            local data, eof = sock:recvchunked(timeout)
+            if not data then
+                return nil, eof
+            end
+
+            if eof then break end
+        end
+    elseif length then
+        if length > 0 then
+            local ok, err = sock:discard(length, timeout)
+            if not ok then
+                return nil, err
+            end
+        end
+    else
+        return nil, 'response without length is not supported with keep-alive'
+    end
+
+    return tonumber(code), close
+end
+
+--[[
+    Takes the next request to be issued. Returns the time the request is scheduled
+    at, false if there's no request ready and block is false, or nil if finished.
+--]]
+local function acquire(ctx, block)
+    if ctx.rate then
+        local queue = ctx.queue
+
+        while true do
+            if queue.head <= queue.tail then
+                local ts = queue[queue.head]
+                queue[queue.head] = nil
+                queue.head = queue.head + 1
+                return ts
+            end
+
+            if ctx.finished then
+                return nil
+            end
+
+            if not block then
+                return false
+            end
+
+            ctx.cond:wait()
+        end
+    end
+
+    if ctx.finished then
+        return nil
+    end
+
+    local now = time.now()
+
+    if (ctx.requests and ctx.issued >= ctx.requests) or (ctx.deadline and now >= ctx.deadline) then
+        ctx.finished = true
+        return nil
+    end
+
+    ctx.issued = ctx.issued + 1
+
+    return now
+end
+
+local function record(ctx, ts, code, err)
+    local stats = ctx.stats
+
+    if not code then
+        stats.errors = stats.errors + 1
+        stats.error_msgs[err] = (stats.error_msgs[err] or 0) + 1
+        return
+    end
+
+    stats.completed = stats.completed + 1
+    stats.codes[code] = (stats.codes[code] or 0) + 1
+    stats.latency:record((time.now() - ts) * 1000000)
+end
+
+local function connect(ctx)
+    if ctx.use_ssl then
+        local ssl = require 'eco.ssl'
+        return ssl.connect(ctx.address, ctx.port, { insecure = true, ipv6 = ctx.ipv6 })
+    end
+
+    return socket.connect_tcp(ctx.address, ctx.port, { ipv6 = ctx.ipv6 })
+end
+
+local function keepalive_worker(ctx)
+    local depth = ctx.pipeline
+    local req = ctx.request
+    local pending = {}
+    local sock
+
+    while true do
+        local batch = {}
+
+        while #pending < depth do
+            local ts = acquire(ctx, #pending == 0)
+            if not ts then break end
+
+            batch[#batch + 1] = req
+            pending[#pending + 1] = ts
+        end
+
+        if #pending == 0 then break end
+
+        local err
+
+        if not sock then
+            sock, err = connect(ctx)
+            if sock then
+                ctx.stats.connects = ctx.stats.connects + 1
+            end
+        end
+
+        if sock and #batch > 0 then
+            _, err = sock:send(concat(batch))
+        end
+
+        local code, close
+
+        if not err then
+            code, close = read_response(sock, ctx.method, ctx.timeout)
+            if not code then
+                err = close
+            end
+        end
+
+        if err then
+            for _, ts in ipairs(pending) do
+                record(ctx, ts, nil, err)
+            end
+
+            pending = {}
+        else
+            record(ctx, table.remove(pending, 1), code)
+
+            -- requests pipelined after a closing response will never be answered
+            if close then
+                for _, ts in ipairs(pending) do
+                    record(ctx, ts, nil, 'closed')
+                end
+
+                pending = {}
+            end
+        end
+
+        if sock and (err or close) then
+            sock:close()
+            sock = nil
+        end
+    end
+
+    if sock then
+        sock:close()
+    end
+end
+
+local function close_worker(ctx)
+    local opts = { timeout = ctx.timeout, headers = ctx.headers }
+
+    while true do
+        local ts = acquire(ctx, true)
+        if not ts then break end
+
+        local resp, err = client.request(ctx.method, ctx.url, ctx.body, opts)
+
+        ctx.stats.connects = ctx.stats.connects + 1
+
+        record(ctx, ts, resp and resp.code, err)
+    end
+end
+
+local function scheduler(ctx)
+    local queue = ctx.queue
+    local interval = 1 / ctx.rate
+    local start = ctx.start
+    local n = 0
+
+    while true do
+        local now = time.now()
+
+        -- enqueue all the requests due by now
+        while start + n * interval <= now do
+            if (ctx.requests and n >= ctx.requests) or (ctx.deadline and start + n * interval >= ctx.deadline) then
+                ctx.finished = true
+                ctx.cond:broadcast()
+                return
+            end
+
+            queue.tail = queue.tail + 1
+            queue[queue.tail] = start + n * interval
+            n = n + 1
+        end
+
+        ctx.cond:broadcast()
+
+        time.sleep(math.max(start + n * interval - time.now(), 0.001))
+    end
+end
+
+--[[
+    Runs a HTTP benchmark and returns the statistics.
+
+    opts is a table contains the following fields:
+        url: The url to be requested.
+        method: HTTP request method, defaults to "GET".
+        headers: A table contains extra request headers.
+        body: The request body as a string.
+        connections: Number of concurrent connections, defaults to 10.
+        requests: Total number of requests to issue.
+        duration: Test duration in seconds, defaults to 10 if requests is not given.
+        keepalive: A boolean, reuse connections. Without it every request is issued with
+                   http.client on a new connection.
+        pipeline: Number of requests in flight on each connection, implies keepalive. Defaults to 1.
+        rate: Requests per second for all connections (open loop). Latency is measured
+              from the time each request is scheduled, so that queuing delay is included.
+        timeout: Response timeout in seconds, defaults to 5.
+
+    The returned table contains the following fields:
+        elapsed: Test duration in seconds.
+        completed: Number of completed requests.
+        errors: Number of failed requests.
+        error_msgs: A table maps error message to its count.
+        codes: A table maps status code to its count.
+        connects: Number of connections established.
+        rps: Completed requests per second.
+        latency: A histogram of latency in microseconds, with methods
+                 count, mean, stdev, percentile(p).
+--]]
+function M.run(opts)
+    assert(type(opts) == 'table' and opts.url, 'url is required')
+
+    local u, err = URL.parse(opts.url)
+    if not u then
+        return nil, err
+    end
+
+    if u.scheme ~= 'http' and u.scheme ~= 'https' then
+        return nil, 'unsupported scheme: ' .. u.scheme
+    end
+
+    local port = u.port or (u.scheme == 'https' and 443 or 80)
+    local host = u.host
+
+    local ctx = {
+        url = opts.url,
+        method = opts.method or 'GET',
+        path = u.raw_path,
+        headers = opts.headers or {},
+        body = opts.body,
+        port = port,
+        use_ssl = u.scheme == 'https',
+        host_header = (port == 80 or port == 443) and host or host .. ':' .. port,
+        connections = opts.connections or 10,
+        requests = opts.requests,
+        rate = opts.rate,
+        pipeline = opts.pipeline or 1,
+        timeout = opts.timeout or 5,
+        issued = 0,
+        queue = { head = 1, tail = 0 },
+        cond = sync.cond(),
+        stats = {
+            completed = 0,
+            errors = 0,
+            connects = 0,
+            error_msgs = {},
+            codes = {},
+            latency = M.histogram()
+        }
+    }
+
+    assert(ctx.connections > 0, 'connections must be greater than 0')
+    assert(ctx.pipeline > 0, 'pipeline must be greater than 0')
+
+    local keepalive = opts.keepalive or ctx.pipeline > 1
+
+    if keepalive then
+        local answers, err = dns.query(host, { type = opts.ipv6 and dns.TYPE_AAAA or dns.TYPE_A })
+        if not answers then
+            return nil, 'resolve "' .. host .. '" fail: ' .. err
+        end
+
+        for _, a in ipairs(answers) do
+            if a.type == dns.TYPE_A or a.type == dns.TYPE_AAAA then
+                ctx.address = a.address
+                ctx.ipv6 = a.type == dns.TYPE_AAAA
+                break
+            end
+        end
+
+        if not ctx.address then
+            return nil, 'resolve "' .. host .. '" fail: not found'
+        end
+
+        ctx.request = build_request(ctx)
+    end
+
+    local duration = opts.duration
+
+    if not duration and not ctx.requests then
+        duration = 10
+    end
+
+    ctx.start = time.now()
+
+    if duration then
+        ctx.deadline = ctx.start + duration
+    end
+
+    local wg = sync.waitgroup()
+
+    wg:add(ctx.connections)
+
+    for _ = 1, ctx.connections do
+        eco.run(function()
+            if keepalive then
+                keepalive_worker(ctx)
+            else
+                close_worker(ctx)
+            end
+            wg:done()
+        end)
+    end
+
+    if ctx.rate then
+        eco.run(scheduler, ctx)
+    end
+
+    wg:wait()
+
+    local stats = ctx.stats
+
+    stats.elapsed = time.now() - ctx.start
+    stats.rps = stats.completed / stats.elapsed
+
+    return stats
+end
+
+local report_percentiles = { 50, 75, 90, 99, 99.9, 99.99, 100 }
+
+-- Formats the statistics returned by run as a human readable report.
+function M.report(stats)
+    local latency = stats.latency
+    local lines = {}
+
+    lines[#lines + 1] = string.format('  Latency(ms)    mean: %.3f    stdev: %.3f    max: %.3f',
+        latency:mean() / 1000, latency:stdev() / 1000, (latency.max or 0) / 1000)
+
+    lines[#lines + 1] = '  Latency distribution(ms):'
+
+    for _, p in ipairs(report_percentiles) do
+        lines[#lines + 1] = string.format('    %7s%%  %.3f', p, latency:percentile(p) / 1000)
+    end
+
+    lines[#lines + 1] = string.format('  %d requests in %.2fs, %d errors, %d connections',
+        stats.completed, stats.elapsed, stats.errors, stats.connects)
+
+    local codes = {}
+
+    for code, n in pairs(stats.codes) do
+        codes[#codes + 1] = string.format('%d: %d', code, n)
+    end
+
+    table.sort(codes)
+
+    if #codes > 0 then
+        lines[#lines + 1] = '  Status codes: ' .. concat(codes, ', ')
+    end
+
+    for msg, n in pairs(stats.error_msgs) do
+        lines[#lines + 1] = string.format('  Error "%s": %d', msg, n)
+    end
+
+    lines[#lines + 1] = string.format('Requests/sec: %.2f', stats.rps)
+
+    return concat(lines, '\n')
+end
+
+return M
@@ -3,6 +3,8 @@
 
 local base64 = require 'eco.encoding.base64'
 local socket = require 'eco.socket'
+local sync = require 'eco.sync'
+local time = require 'eco.time'
 local URL = require 'eco.http.url'
 local file = require 'eco.file'
 local ssl = require 'eco.ssl'
@@ -126,7 +128,10 @@ local function receive_body_until_closed(resp, sock, timeout, body_to_file)
         end
 
         if body_to_file then
-            body_to_file:write(data)
+            local ok, err = body_to_file:write(data)
+            if not ok then
+                return nil, err
+            end
         else
             body[#body+1] = data
         end
@@ -151,7 +156,10 @@ local function receive_body(resp, sock, timeout, length, body_to_file)
         length = length - #data
 
         if body_to_file then
-            body_to_file:write(data)
+            local ok, err = body_to_file:write(data)
+            if not ok then
+                return nil, err
+            end
         else
             body[#body+1] = data
         end
@@ -165,47 +173,89 @@ local function receive_body(resp, sock, timeout, length, body_to_file)
 end
 
 local function receive_chunked_body(resp, sock, timeout, body_to_file)
-    local chunk_size
     local body = {}
 
     while true do
-        -- first read chunk size
-        local data, err = sock:recv('l', timeout)
+        local data, eof, trailers = sock:recvchunked(timeout)
         if not data then
-            return nil, err
+            return nil, eof
         end
 
-        data = data:match('^%x+\r?')
-        if not data then
-            return nil, 'not a vaild http chunked body'
+        if body_to_file then
+            local ok, err = body_to_file:write(data)
+            if not ok then
+                return nil, err
+            end
+        else
+            body[#body + 1] = data
         end
 
-        chunk_size = tonumber(data, 16)
-
-        if chunk_size == 0 then
+        if eof then
             if not body_to_file then
                 resp.body = concat(body)
             end
+
+            resp.trailers = trailers
+
             return true
         end
+    end
+end
 
-        -- second read chunk data
-        data, err = sock:readfull(chunk_size, timeout)
-        if not data then
-            return nil, err
-        end
+local body_decoder_methods = {}
 
-        if body_to_file then
-            body_to_file:write(data)
-        else
-            body[#body + 1] = data
-        end
+function body_decoder_methods:write(data)
+    local err
 
-        data, err = sock:recv('l', timeout)
-        if not data then
-            return nil, err
-        end
+    self.input = self.input + #data
+
+    data, err = self.stream:update(data)
+    if not data then
+        return nil, 'decompress body fail: ' .. err
     end
+
+    if #data == 0 then
+        return true
+    end
+
+    if self.file then
+        return self.file:write(data)
+    end
+
+    local body = self.body
+    body[#body + 1] = data
+
+    return true
+end
+
+function body_decoder_methods:finish(resp)
+    local finished = self.stream:finished()
+
+    self.stream:close()
+
+    -- an empty body, e.g. Content-Length: 0, isn't a compressed stream at all
+    if not finished and self.input > 0 then
+        return nil, 'decompress body fail: incomplete data'
+    end
+
+    if not self.file then
+        resp.body = concat(self.body)
+    end
+
+    return true
+end
+
+local body_decoder_metatable = { __index = body_decoder_methods }
+
+local function create_body_decoder(encoding, body_to_file)
+    local zlib = require 'eco.zlib'
+
+    local stream, err = zlib.inflate(encoding == 'deflate' and 'deflate' or 'gzip')
+    if not stream then
+        return nil, err
+    end
+
+    return setmetatable({ stream = stream, file = body_to_file, body = {}, input = 0 }, body_decoder_metatable)
 end
 
 local function do_http_request(self, method, path, headers, body, opts)
@@ -252,13 +302,39 @@ local function do_http_request(self, method, path, headers, body, opts)
         body_to_file = f
     end
 
+    local decoder
+
+    if opts.decompress then
+        local encoding = (headers['content-encoding'] or ''):lower()
+
+        if encoding == 'gzip' or encoding == 'x-gzip' or encoding == 'deflate' then
+            decoder, err = create_body_decoder(encoding, body_to_file)
+            if not decoder then
+                if body_to_file then
+                    body_to_file:close()
+                end
+                return nil, err
+            end
+        end
+    end
+
+    local sink = decoder or body_to_file
+
     if headers['transfer-encoding'] == 'chunked' then
-        ok, err = receive_chunked_body(resp, sock, timeout, body_to_file)
+        ok, err = receive_chunked_body(resp, sock, timeout, sink)
     elseif headers['content-length'] then
         local content_length = tonumber(headers['content-length'])
-        ok, err = receive_body(resp, sock, timeout, content_length, body_to_file)
+        ok, err = receive_body(resp, sock, timeout, content_length, sink)
     else
-        ok, err = receive_body_until_closed(resp, sock, timeout, body_to_file)
+        ok, err = receive_body_until_closed(resp, sock, timeout, sink)
+    end
+
+    if decoder then
+        if ok then
+            ok, err = decoder:finish(resp)
+        else
+            decoder.stream:close()
+        end
     end
 
     if body_to_file then
@@ -282,7 +358,21 @@ function methods:close()
     end
 
     sock:close()
-    self.sock = nil
+    self.__sock = nil
+end
+
+--[[
+    Aborts the request in progress, e.g. from another coroutine, which fails with
+    err (defaults to "canceled"). A request still resolving the host or connecting
+    stops there, without sending anything.
+--]]
+function methods:cancel(err)
+    self.__canceled = err or 'canceled'
+
+    local sock = self.__sock
+    if sock then
+        sock:shutdown()
+    end
 end
 
 function methods:sock()
@@ -314,6 +404,8 @@ local schemes = {
 function methods:request(method, url, body, opts)
     opts = opts or {}
 
+    self.__canceled = nil
+
     local u, err = URL.parse(url)
     if not u then
         return nil, err
@@ -371,6 +463,10 @@ function methods:request(method, url, body, opts)
         end
     end
 
+    if opts.decompress then
+        headers['accept-encoding'] = 'gzip, deflate'
+    end
+
     for k, v in pairs(opts.headers or {}) do
         headers[k:lower()] = v
     end
@@ -381,6 +477,10 @@ function methods:request(method, url, body, opts)
         device = opts.device,
         nameservers = opts.nameservers
     })
+    if self.__canceled then
+        return nil, self.__canceled
+    end
+
     if not answers then
         return nil, 'resolve "' .. host .. '" fail: ' .. err
     end
@@ -406,6 +506,13 @@ function methods:request(method, url, body, opts)
             sock, err = socket.connect_tcp(a.address, port, opts)
         end
 
+        if self.__canceled then
+            if sock then
+                sock:close()
+            end
+            return nil, self.__canceled
+        end
+
         if sock then
             break
         end
@@ -425,7 +532,12 @@ function methods:request(method, url, body, opts)
 
     self.__sock = sock
 
-    return do_http_request(self, method, path, headers, body, opts)
+    local resp, err = do_http_request(self, method, path, headers, body, opts)
+    if not resp then
+        return nil, self.__canceled or err
+    end
+
+    return resp
 end
 
 local metatable = {
@@ -446,6 +558,7 @@ end
         insecure: A boolean, SSL connecting with insecure.
         ipv6: A boolean, parse ipv6 address for host.
         body_to_file: A string indicates that the body is to be written to the file.
+        decompress: A boolean, advertise gzip and deflate support and decompress the body.
         mark: a number used to set SO_MARK to socket
         device: a string used to set SO_BINDTODEVICE to socket
         nameservers: see dns.query
@@ -459,7 +572,7 @@ end
         status: response status;
         headers: response headers as a table.
 --]]
-function M.request(method, url, body, opts)
+local function client_request(c, method, url, body, opts)
     if body then
         if type(body) ~= 'string' and not body_is_file(body) and not body_is_form(body) then
             return nil, 'invalid body'
@@ -470,8 +583,12 @@ function M.request(method, url, body, opts)
         body = nil
     end
 
+    return c:request(method, url, body, opts)
+end
+
+function M.request(method, url, body, opts)
     local c = M.new()
-    local resp, err = c:request(method, url, body, opts)
+    local resp, err = client_request(c, method, url, body, opts)
     c:close()
 
     if resp then
@@ -489,6 +606,154 @@ function M.post(url, body, opts)
     return M.request('POST', url, body, opts)
 end
 
+--[[
+    Issues a list of requests concurrently and waits for them to complete.
+
+    requests: A list, each item can be an url string (GET request) or a table
+              contains the following fields:
+        method: HTTP request method, defaults to "GET".
+        url: HTTP request url.
+        body: see M.request.
+        opts: see M.request, its timeout is also the deadline of this request, which
+              fails with error "timeout" when it expires.
+
+    opts: A table contains some options:
+        concurrency: Maximum number of requests in flight at the same time, defaults to 10.
+        timeout: The deadline of the whole batch in seconds. Requests not completed
+                 when it expires are reported with error "timeout".
+        on_response: A function called as on_response(i, resp, err) when the i'th
+                     request completes. Returning false cancels the batch: no more
+                     requests are issued and the pending ones are reported with error "canceled".
+                     An error raised by it is reported in the field 'err' of the i'th result.
+
+    The requests in flight are aborted (see method cancel) when the batch is canceled
+    or timed out. An error raised while issuing a request is reported as its 'err'.
+
+    Returns a list of results in the same order as requests, each result is a table
+    contains the field 'resp' on success or 'err' on failure.
+--]]
+function M.batch(requests, opts)
+    opts = opts or {}
+
+    local concurrency = opts.concurrency or 10
+    local on_response = opts.on_response
+    local total = #requests
+    local results = {}
+    local done = 0
+    local index = 1
+    local finished = total == 0
+    local cond = sync.cond()
+    local live = {}
+
+    assert(concurrency > 0, 'concurrency must be greater than 0')
+
+    local function finish()
+        if not finished then
+            finished = true
+            cond:signal()
+        end
+    end
+
+    local function do_request(c, req)
+        if type(req) == 'string' then
+            req = { url = req }
+        end
+
+        local timeout = req.opts and req.opts.timeout
+        local tmr
+
+        if timeout and timeout > 0 then
+            tmr = time.at(timeout, function() c:cancel('timeout') end)
+        end
+
+        local resp, err = client_request(c, req.method or 'GET', req.url, req.body, req.opts)
+
+        if tmr then
+            tmr:cancel()
+        end
+
+        return resp, err
+    end
+
+    local function worker()
+        while not finished and index <= total do
+            local i = index
+
+            index = index + 1
+
+            local c = M.new()
+            live[c] = true
+
+            local ok, resp, err = pcall(do_request, c, requests[i])
+
+            live[c] = nil
+            c:close()
+
+            if finished then return end
+
+            if not ok then
+                resp, err = nil, resp
+            end
+
+            results[i] = { resp = resp, err = err }
+            done = done + 1
+
+            if on_response then
+                local ret
+
+                ok, ret = pcall(on_response, i, resp, err)
+                if not ok then
+                    results[i].err = ret
+                elseif ret == false then
+                    finish()
+                    return
+                end
+            end
+
+            if done == total then
+                finish()
+                return
+            end
+        end
+    end
+
+    for _ = 1, math.min(concurrency, total) do
+        eco.run(worker)
+    end
+
+    local deadline = opts.timeout and time.now() + opts.timeout
+    local err = 'canceled'
+
+    while not finished do
+        local remain
+
+        if deadline then
+            remain = deadline - time.now()
+
+            if remain <= 0 then
+                finished = true
+                err = 'timeout'
+                break
+            end
+        end
+
+        cond:wait(remain)
+    end
+
+    -- the requests in flight fail and close their clients
+    for c in pairs(live) do
+        c:cancel(err)
+    end
+
+    for i = 1, total do
+        if not results[i] then
+            results[i] = { err = err }
+        end
+    end
+
+    return results
+end
+
 local body_file_mt = { name = BODY_FILE_MT }
 
 function M.body_with_file(name)
@@ -402,7 +402,55 @@ function methods:flush()
     return true
 end
 
+local function read_chunked_body(self, count, timeout)
+    local chunked = self.chunked
+    local data = {}
+    local size = 0
+
+    while true do
+        local pending = chunked.pending
+
+        if #pending > 0 then
+            if count and size + #pending > count then
+                data[#data + 1] = pending:sub(1, count - size)
+                chunked.pending = pending:sub(count - size + 1)
+                return concat(data)
+            end
+
+            data[#data + 1] = pending
+            size = size + #pending
+            chunked.pending = ''
+
+            if size == count then
+                return concat(data)
+            end
+        end
+
+        if chunked.eof then
+            return concat(data)
+        end
+
+        local eof, trailers
+
+        pending, eof, trailers = self.sock:recvchunked(timeout, self.options.max_body_size)
+        if not pending then
+            return nil, eof
+        end
+
+        chunked.pending = pending
+
+        if eof then
+            chunked.eof = true
+            chunked.trailers = trailers
+        end
+    end
+end
+
 function methods:read_body(count, timeout)
+    if self.chunked then
+        return read_chunked_body(self, count, timeout)
+    end
+
     local body_remain = self.body_remain
     local sock = self.sock
 
@@ -425,8 +473,116 @@ function methods:read_body(count, timeout)
     return data
 end
 
+--[[
+    The multipart parser reads a chunked body through the same decoder as
+    read_body, the decoded data is buffered in chunked.pending.
+--]]
+local function chunked_fill(self, timeout)
+    local chunked = self.chunked
+
+    if chunked.eof then
+        return nil, 'bad request'
+    end
+
+    local data, eof, trailers = self.sock:recvchunked(timeout, self.options.max_body_size)
+    if not data then
+        return nil, eof
+    end
+
+    chunked.pending = chunked.pending .. data
+
+    if eof then
+        chunked.eof = true
+        chunked.trailers = trailers
+    end
+
+    return true
+end
+
+-- reads a line without the '\n', like sock:recv('l')
+local function form_read_line(self, timeout)
+    local chunked = self.chunked
+
+    if not chunked then
+        return self.sock:recv('l', timeout)
+    end
+
+    while true do
+        local pending = chunked.pending
+        local pos = pending:find('\n', 1, true)
+
+        if pos then
+            chunked.pending = pending:sub(pos + 1)
+            return pending:sub(1, pos - 1)
+        end
+
+        local ok, err = chunked_fill(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+end
+
+-- reads the data before the boundary, like sock:readuntil
+local function form_read_until(self, boundary, timeout)
+    local chunked = self.chunked
+
+    if not chunked then
+        return self.sock:readuntil(boundary, timeout)
+    end
+
+    while true do
+        local pending = chunked.pending
+        local s, e = pending:find(boundary, 1, true)
+
+        if s then
+            chunked.pending = pending:sub(e + 1)
+            return pending:sub(1, s - 1), true
+        end
+
+        -- keeps the tail, which may be the beginning of the boundary
+        local keep = #boundary - 1
+
+        if #pending > keep then
+            chunked.pending = pending:sub(-keep)
+            return pending:sub(1, #pending - keep), false
+        end
+
+        local ok, err = chunked_fill(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+end
+
+local function form_peek(self, n, timeout)
+    local chunked = self.chunked
+
+    if not chunked then
+        return self.sock:peek(n, timeout)
+    end
+
+    while #chunked.pending < n do
+        local ok, err = chunked_fill(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    return chunked.pending:sub(1, n)
+end
+
+local function form_skip(self, n)
+    local chunked = self.chunked
+
+    if not chunked then
+        return self.sock:recv(n)
+    end
+
+    chunked.pending = chunked.pending:sub(n + 1)
+end
+
 function methods:read_formdata(req, timeout)
-    local sock = self.sock
 
     local form = req.form
 
@@ -448,7 +604,7 @@ function methods:read_formdata(req, timeout)
     end
 
     if form.state == 'init' then
-        local line, err = sock:recv('l', timeout)
+        local line, err = form_read_line(self, timeout)
         if not line then
             return nil, err
         end
@@ -463,7 +619,7 @@ function methods:read_formdata(req, timeout)
     end
 
     if form.state == 'header' then
-        local line, err = sock:recv('l', timeout)
+        local line, err = form_read_line(self, timeout)
         if not line then
             return nil, err
         end
@@ -481,13 +637,13 @@ function methods:read_formdata(req, timeout)
     end
 
     if form.state == 'body' then
-        local data, found = sock:readuntil(form.boundary, timeout)
+        local data, found = form_read_until(self, form.boundary, timeout)
         if not data then
             return nil, found
         end
 
         if found then
-            local x, err = sock:peek(2)
+            local x, err = form_peek(self, 2, timeout)
             if not x then
                 return nil, err
             end
@@ -499,7 +655,7 @@ function methods:read_formdata(req, timeout)
                     return nil, 'bad request'
                 end
 
-                sock:recv(2)
+                form_skip(self, 2)
 
                 form.state = 'header'
             end
@@ -512,7 +668,24 @@ function methods:read_formdata(req, timeout)
 end
 
 function methods:discard_body()
-    local ok, err = self.sock:discard(self.body_remain)
+    local chunked = self.chunked
+
+    if chunked then
+        chunked.pending = ''
+
+        while not chunked.eof do
+            local data, eof = self.sock:recvchunked(self.read_timeout, self.options.max_body_size)
+            if not data then
+                return nil, eof
+            end
+
+            chunked.eof = eof
+        end
+
+        return true
+    end
+
+    local ok, err = self.sock:discard(self.body_remain, self.read_timeout)
     if not ok then
         return nil, err
     end
@@ -668,8 +841,9 @@ local function handle_connection(con, handler)
     end
 
     if str_lower(headers['transfer-encoding'] or '') == 'chunked' then
-        log.err(log_prefix .. 'not support chunked http request')
-        return false
+        con.chunked = { pending = '' }
+    else
+        con.chunked = nil
     end
 
     local query_string = ''
@@ -689,6 +863,7 @@ local function handle_connection(con, handler)
     end
 
     con.body_remain = tonumber(headers['content-length'] or 0)
+    con.read_timeout = read_timeout
 
     local resp = {
         major_version = major_version,
@@ -718,7 +893,12 @@ local function handle_connection(con, handler)
         form = {}
     }
 
-    if handler(con, req) == false then
+    local max_body_size = con.options.max_body_size
+
+    -- the body isn't read, so the connection is closed after the response
+    if max_body_size and con.body_remain > max_body_size then
+        con:send_error(M.STATUS_PAYLOAD_TOO_LARGE)
+    elseif handler(con, req) == false then
         return false
     end
 
@@ -741,8 +921,10 @@ local function handle_connection(con, handler)
         return false
     end
 
-    log.debug(log_prefix .. string.format('"%s %s HTTP/%d.%d" %d',
-        method, path, major_version, minor_version, resp.code))
+    log.debug(function()
+        return log_prefix .. string.format('"%s %s HTTP/%d.%d" %d',
+            method, path, major_version, minor_version, resp.code)
+    end)
 
     local req_connection = str_lower(req.headers['connection'] or '')
     local resp_connection = str_lower(resp.headers['connection'] or '')
@@ -767,6 +949,17 @@ end
 
 local metatable = { __index = methods }
 
+--[[
+    Runs a HTTP server, the handler is called with the connection and the request.
+
+    options is an optional Table that supports the following fields:
+    docroot, index: the document root and the index file served by serve_file
+    http_keepalive: the keep-alive timeout in seconds, defaults to 30, 0 disables keep-alive
+    cert, key: serve HTTPS, see ssl.listen
+    max_body_size: the max size in bytes of a request body, a larger Content-Length
+                   is answered with 413, and reading a larger chunked body fails
+                   with 'body too large'. Defaults to unlimited.
+--]]
 function M.listen(ipaddr, port, options, handler)
     options = options or {}
 
@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#include <sys/inotify.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "eco.h"
+
+#define INOTIFY_READ_BUF (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+static int lua_inotify_init(lua_State *L)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+static int lua_inotify_add_watch(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    uint32_t mask = luaL_checkinteger(L, 3);
+    int wd;
+
+    wd = inotify_add_watch(fd, path, mask);
+    if (wd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, wd);
+    return 1;
+}
+
+static int lua_inotify_rm_watch(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    int wd = luaL_checkinteger(L, 2);
+
+    if (inotify_rm_watch(fd, wd)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/*
+ * Reads all the queued events without blocking, and appends them to the
+ * table at index 2 if given. Each event is a table with wd, mask, cookie
+ * and the optional name. It returns the table, which is empty if no event
+ * is queued.
+ */
+static int lua_inotify_read(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    char buf[INOTIFY_READ_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int n;
+
+    if (lua_istable(L, 2)) {
+        lua_settop(L, 2);
+    } else {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    }
+
+    n = lua_rawlen(L, 2);
+
+    while (true) {
+        const struct inotify_event *e;
+        ssize_t len;
+        char *p;
+
+        len = read(fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN)
+                break;
+
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + e->len) {
+            e = (const struct inotify_event *)p;
+
+            lua_createtable(L, 0, 4);
+
+            lua_pushinteger(L, e->wd);
+            lua_setfield(L, -2, "wd");
+
+            lua_pushinteger(L, e->mask);
+            lua_setfield(L, -2, "mask");
+
+            lua_pushinteger(L, e->cookie);
+            lua_setfield(L, -2, "cookie");
+
+            if (e->len) {
+                lua_pushstring(L, e->name);
+                lua_setfield(L, -2, "name");
+            }
+
+            lua_rawseti(L, 2, ++n);
+        }
+    }
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"init", lua_inotify_init},
+    {"add_watch", lua_inotify_add_watch},
+    {"rm_watch", lua_inotify_rm_watch},
+    {"read", lua_inotify_read},
+    {NULL, NULL}
+};
+
+int luaopen_eco_core_inotify(lua_State *L)
+{
+    luaL_newlib(L, funcs);
+
+    lua_add_constant(L, "IN_ACCESS", IN_ACCESS);
+    lua_add_constant(L, "IN_MODIFY", IN_MODIFY);
+    lua_add_constant(L, "IN_ATTRIB", IN_ATTRIB);
+    lua_add_constant(L, "IN_CLOSE_WRITE", IN_CLOSE_WRITE);
+    lua_add_constant(L, "IN_CLOSE_NOWRITE", IN_CLOSE_NOWRITE);
+    lua_add_constant(L, "IN_CLOSE", IN_CLOSE);
+    lua_add_constant(L, "IN_OPEN", IN_OPEN);
+    lua_add_constant(L, "IN_MOVED_FROM", IN_MOVED_FROM);
+    lua_add_constant(L, "IN_MOVED_TO", IN_MOVED_TO);
+    lua_add_constant(L, "IN_MOVE", IN_MOVE);
+    lua_add_constant(L, "IN_CREATE", IN_CREATE);
+    lua_add_constant(L, "IN_DELETE", IN_DELETE);
+    lua_add_constant(L, "IN_DELETE_SELF", IN_DELETE_SELF);
+    lua_add_constant(L, "IN_MOVE_SELF", IN_MOVE_SELF);
+    lua_add_constant(L, "IN_ALL_EVENTS", IN_ALL_EVENTS);
+
+    lua_add_constant(L, "IN_UNMOUNT", IN_UNMOUNT);
+    lua_add_constant(L, "IN_Q_OVERFLOW", IN_Q_OVERFLOW);
+    lua_add_constant(L, "IN_IGNORED", IN_IGNORED);
+
+    lua_add_constant(L, "IN_ONLYDIR", IN_ONLYDIR);
+    lua_add_constant(L, "IN_DONT_FOLLOW", IN_DONT_FOLLOW);
+    lua_add_constant(L, "IN_EXCL_UNLINK", IN_EXCL_UNLINK);
+    lua_add_constant(L, "IN_MASK_ADD", IN_MASK_ADD);
+    lua_add_constant(L, "IN_ISDIR", IN_ISDIR);
+    lua_add_constant(L, "IN_ONESHOT", IN_ONESHOT);
+
+    return 1;
+}
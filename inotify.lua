@@ -0,0 +1,329 @@
+-- SPDX-License-Identifier: MIT
+-- Author: Jianhui Zhao <zhaojh329@gmail.com>
+
+local inotify = require 'eco.core.inotify'
+local file = require 'eco.core.file'
+local time = require 'eco.time'
+
+local M = {}
+
+local IN_CREATE = inotify.IN_CREATE
+local IN_MOVED_TO = inotify.IN_MOVED_TO
+local IN_MOVED_FROM = inotify.IN_MOVED_FROM
+local IN_DELETE = inotify.IN_DELETE
+local IN_ISDIR = inotify.IN_ISDIR
+local IN_IGNORED = inotify.IN_IGNORED
+local IN_Q_OVERFLOW = inotify.IN_Q_OVERFLOW
+
+-- the events reported regardless of the mask of the watch
+local IN_ALWAYS = IN_IGNORED | inotify.IN_UNMOUNT | IN_Q_OVERFLOW
+
+-- the events needed to follow the subdirectories of a recursive watch
+local IN_SUBDIR = IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE
+
+M.DEFAULT_MASK = inotify.IN_MODIFY | inotify.IN_ATTRIB | inotify.IN_CLOSE_WRITE | inotify.IN_MOVE
+    | IN_CREATE | IN_DELETE | inotify.IN_DELETE_SELF | inotify.IN_MOVE_SELF
+
+local methods = {}
+
+local function join(dir, name)
+    if dir:sub(-1) == '/' then
+        return dir .. name
+    end
+
+    return dir .. '/' .. name
+end
+
+--[[
+    The events of a batch are coalesced by path, the masks of the events
+    on the same path are ORed together.
+--]]
+local function batch_push(batch, path, mask, cookie)
+    local ev = batch.index[path]
+
+    if ev then
+        ev.mask = ev.mask | mask
+        if cookie > 0 then
+            ev.cookie = cookie
+        end
+        return
+    end
+
+    ev = { path = path, mask = mask, cookie = cookie }
+
+    batch.index[path] = ev
+    batch.events[#batch.events + 1] = ev
+end
+
+local function watch_remove(self, wd)
+    local w = self.wds[wd]
+    if not w then
+        return
+    end
+
+    self.wds[wd] = nil
+
+    if self.paths[w.path] == wd then
+        self.paths[w.path] = nil
+    end
+end
+
+-- removes the watches of the path and all the paths under it
+local function watch_remove_tree(self, path)
+    local prefix = join(path, '')
+
+    for p, wd in pairs(self.paths) do
+        if p == path or p:sub(1, #prefix) == prefix then
+            inotify.rm_watch(self.fd, wd)
+            watch_remove(self, wd)
+        end
+    end
+end
+
+local watch_add
+
+--[[
+    Watches the subdirectories of a recursive watch. The entries found in a
+    new directory are reported as created, since they may be created before
+    the directory is watched.
+--]]
+local function watch_subdirs(self, path, mask, batch)
+    for name, info in file.dir(path) do
+        if name ~= '.' and name ~= '..' then
+            local subpath = join(path, name)
+            local isdir = info.type == 'DIR'
+
+            if batch and mask & IN_CREATE ~= 0 then
+                batch_push(batch, subpath, IN_CREATE | (isdir and IN_ISDIR or 0), 0)
+            end
+
+            if isdir then
+                watch_add(self, subpath, mask, true, batch, true)
+            end
+        end
+    end
+end
+
+watch_add = function(self, path, mask, recursive, batch, subdir)
+    local kmask = mask
+
+    if recursive then
+        kmask = kmask | IN_SUBDIR
+    end
+
+    -- the symbolic links to directories are never followed
+    if subdir then
+        kmask = kmask | inotify.IN_ONLYDIR | inotify.IN_DONT_FOLLOW
+    end
+
+    local wd, err = inotify.add_watch(self.fd, path, kmask)
+    if not wd then
+        return nil, err
+    end
+
+    self.wds[wd] = { path = path, mask = mask, recursive = recursive, subdir = subdir }
+    self.paths[path] = wd
+
+    if recursive then
+        watch_subdirs(self, path, mask, batch)
+    end
+
+    return true
+end
+
+local function handle_event(self, e, batch)
+    if e.mask & IN_Q_OVERFLOW ~= 0 then
+        batch_push(batch, '', IN_Q_OVERFLOW, 0)
+        return
+    end
+
+    local w = self.wds[e.wd]
+    if not w then
+        return
+    end
+
+    local path = e.name and join(w.path, e.name) or w.path
+
+    if e.mask & IN_IGNORED ~= 0 then
+        watch_remove(self, e.wd)
+    end
+
+    if w.recursive and e.mask & IN_ISDIR ~= 0 and e.name then
+        if e.mask & (IN_MOVED_FROM | IN_DELETE) ~= 0 then
+            watch_remove_tree(self, path)
+        elseif e.mask & (IN_CREATE | IN_MOVED_TO) ~= 0 then
+            watch_add(self, path, w.mask, true, batch, true)
+        end
+    end
+
+    local always = IN_ALWAYS
+
+    -- the watches of subdirectories are removed silently
+    if w.subdir then
+        always = always & ~IN_IGNORED
+    end
+
+    local mask = e.mask & (w.mask | always)
+
+    if mask & ~IN_ISDIR ~= 0 then
+        batch_push(batch, path, mask | (e.mask & IN_ISDIR), e.cookie)
+    end
+end
+
+local function collect(self, batch)
+    local events, err = inotify.read(self.fd)
+    if not events then
+        return nil, err
+    end
+
+    for _, e in ipairs(events) do
+        handle_event(self, e, batch)
+    end
+
+    return true
+end
+
+--[[
+    Adds a watch for the path.
+
+    mask: the events to watch, defaults to inotify.DEFAULT_MASK
+    opts is an optional Table that supports the following fields:
+    recursive: a boolean flag controls whether to watch the subdirectories,
+               including the ones created later
+--]]
+function methods:add(path, mask, opts)
+    opts = opts or {}
+
+    return watch_add(self, path, mask or M.DEFAULT_MASK, opts.recursive)
+end
+
+-- removes the watch of the path and the watches of its subdirectories
+function methods:del(path)
+    if not self.paths[path] then
+        return nil, 'not watched'
+    end
+
+    watch_remove_tree(self, path)
+
+    return true
+end
+
+--[[
+    Waits for events, the optional timeout is in seconds.
+
+    It returns a list of events, each is a table with the following fields:
+    path: the path of the object on which the event occurs, an empty string for IN_Q_OVERFLOW
+    mask: the ORed events occured on the path
+    cookie: the cookie of the last rename event, which associates IN_MOVED_FROM and IN_MOVED_TO
+
+    If debounce is set, it keeps collecting until no event arrives in the
+    debounce period, or max_delay elapses.
+--]]
+function methods:wait(timeout)
+    local batch = { events = {}, index = {} }
+    local deadline = timeout and time.now() + timeout
+
+    local ok, err = collect(self, batch)
+    if not ok then
+        return nil, err
+    end
+
+    while #batch.events == 0 do
+        local remain
+
+        if deadline then
+            remain = deadline - time.now()
+            if remain <= 0 then
+                return nil, 'timeout'
+            end
+        end
+
+        ok, err = self.iow:wait(remain)
+        if not ok then
+            return nil, err
+        end
+
+        ok, err = collect(self, batch)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    if self.debounce > 0 then
+        local last = time.now() + self.max_delay
+
+        while true do
+            local remain = math.min(self.debounce, last - time.now())
+            if remain <= 0 or not self.iow:wait(remain) then
+                break
+            end
+
+            if not collect(self, batch) then
+                break
+            end
+        end
+    end
+
+    return batch.events
+end
+
+--[[
+    Returns an iterator, which yields a batch of events each time. The
+    iteration ends when waiting fails, e.g. timeout.
+
+    for events in w:events() do
+        ...
+    end
+--]]
+function methods:events(timeout)
+    return function()
+        return self:wait(timeout)
+    end
+end
+
+function methods:close()
+    if self.fd < 0 then
+        return
+    end
+
+    self.iow:cancel()
+    file.close(self.fd)
+
+    self.fd = -1
+    self.wds = {}
+    self.paths = {}
+end
+
+local metatable = {
+    __index = methods,
+    __gc = methods.close
+}
+
+--[[
+    Creates an inotify watcher.
+
+    opts is an optional Table that supports the following fields:
+    debounce: coalesces the events arrive within the period in seconds into one batch, defaults to 0
+    max_delay: the max time in seconds a batch is delayed by debounce, defaults to 10 times debounce
+--]]
+function M.new(opts)
+    opts = opts or {}
+
+    local fd, err = inotify.init()
+    if not fd then
+        return nil, err
+    end
+
+    local debounce = opts.debounce or 0
+
+    return setmetatable({
+        fd = fd,
+        iow = eco.watcher(eco.IO, fd),
+        debounce = debounce,
+        max_delay = opts.max_delay or debounce * 10,
+        wds = {},
+        paths = {}
+    }, metatable)
+end
+
+return setmetatable(M, { __index = inotify })
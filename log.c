@@ -3,11 +3,70 @@
  * Author: Jianhui Zhao <zhaojh329@gmail.com>
  */
 
+#include <semaphore.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
 
 #include "log/log.h"
 #include "eco.h"
 
+#define LOG_ASYNC_DEFAULT_SIZE  (1024 * 1024)
+#define LOG_ASYNC_MIN_SIZE      (64 * 1024)
+#define LOG_ASYNC_ALIGN         16
+
+enum {
+    LOG_OVERFLOW_DROP,
+    LOG_OVERFLOW_BLOCK,
+    LOG_OVERFLOW_COUNT
+};
+
+/*
+ * A record in the ring, followed by the NUL-terminated filename and
+ * message. A record with a negative priority pads the end of the ring.
+ */
+struct log_record {
+    uint32_t size;
+    int32_t line;
+    int16_t priority;
+    uint16_t flen;
+    uint32_t mlen;
+};
+
+/*
+ * The records are produced by the loop thread and consumed by the writer
+ * thread, which passes them to the log sink in batches. head is written
+ * by the producer only, and tail by the consumer only, so no lock is
+ * taken on either side.
+ */
+static struct log_async {
+    bool running;
+    int overflow;
+    char *ring;
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    bool waiting;       /* the writer is sleeping on wake */
+    bool blocked;       /* the producer is sleeping on space */
+    bool stop;
+    sem_t wake;
+    sem_t space;
+    pthread_t tid;
+    /* statistics */
+    uint64_t queued;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t blocks;
+    uint64_t lost;      /* dropped but not reported yet, see __lua_log */
+} log_async;
+
 static int lua_log_set_level(lua_State *L)
 {
     int level = luaL_checkinteger(L, 1);
@@ -17,76 +76,748 @@ static int lua_log_set_level(lua_State *L)
     return 0;
 }
 
-static void __lua_log(lua_State *L, int priority)
+static inline uint64_t log_async_used(struct log_async *a)
 {
-    static char buf[BUFSIZ];
-    size_t room = BUFSIZ - 1;
-    const char *filename = "";
-    int line = -1;
-    char *pos = buf;
-    lua_Debug ar;
-    int n, i;
+    return a->head - __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+}
 
-    priority = LOG_PRI(priority);
+static void log_async_wakeup(struct log_async *a)
+{
+    if (__atomic_exchange_n(&a->waiting, false, __ATOMIC_SEQ_CST))
+        sem_post(&a->wake);
+}
 
-    if (priority > __log_level__)
+static void log_async_write(const struct log_record *r)
+{
+    const char *filename = (const char *)(r + 1);
+
+    ___log(filename, r->line, r->priority, "%s", filename + r->flen + 1);
+}
+
+static void *log_async_thread(void *arg)
+{
+    struct log_async *a = arg;
+    uint64_t mask = a->size - 1;
+    uint64_t tail = a->tail;
+
+    while (true) {
+        uint64_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (__atomic_load_n(&a->stop, __ATOMIC_SEQ_CST))
+                break;
+
+            __atomic_store_n(&a->waiting, true, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&a->head, __ATOMIC_SEQ_CST) == tail &&
+                    !__atomic_load_n(&a->stop, __ATOMIC_SEQ_CST)) {
+                while (sem_wait(&a->wake) && errno == EINTR)
+                    ;
+            }
+            continue;
+        }
+
+        /* drains all the records published so far in one batch */
+        while (tail != head) {
+            const struct log_record *r = (const struct log_record *)(a->ring + (tail & mask));
+
+            if (r->priority >= 0) {
+                log_async_write(r);
+                __atomic_add_fetch(&a->written, 1, __ATOMIC_RELAXED);
+            }
+
+            tail += r->size;
+            __atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (__atomic_exchange_n(&a->blocked, false, __ATOMIC_SEQ_CST))
+            sem_post(&a->space);
+    }
+
+    return NULL;
+}
+
+/*
+ * Copies a message into the ring. It returns false if the ring is full,
+ * and the caller counts the message as dropped.
+ */
+static bool log_async_push(struct log_async *a, int priority, const char *filename, int line,
+        const char *msg, size_t mlen)
+{
+    uint64_t mask = a->size - 1;
+    size_t flen = strlen(filename);
+    struct log_record *r;
+    uint64_t size, pad;
+    char *p;
+
+    size = (sizeof(struct log_record) + flen + mlen + 2 + LOG_ASYNC_ALIGN - 1) & ~(uint64_t)(LOG_ASYNC_ALIGN - 1);
+
+    /* a record never wraps around the end of the ring */
+    pad = a->size - (a->head & mask);
+    if (pad >= size)
+        pad = 0;
+
+    while (a->size - log_async_used(a) < size + pad) {
+        if (a->overflow != LOG_OVERFLOW_BLOCK)
+            return false;
+
+        __atomic_store_n(&a->blocked, true, __ATOMIC_SEQ_CST);
+
+        log_async_wakeup(a);
+
+        if (a->size - log_async_used(a) >= size + pad)
+            break;
+
+        a->blocks++;
+
+        while (sem_wait(&a->space) && errno == EINTR)
+            ;
+    }
+
+    if (pad) {
+        r = (struct log_record *)(a->ring + (a->head & mask));
+        r->size = pad;
+        r->priority = -1;
+        a->head += pad;
+    }
+
+    r = (struct log_record *)(a->ring + (a->head & mask));
+    r->size = size;
+    r->line = line;
+    r->priority = priority;
+    r->flen = flen;
+    r->mlen = mlen;
+
+    p = (char *)(r + 1);
+    memcpy(p, filename, flen + 1);
+    p += flen + 1;
+    memcpy(p, msg, mlen);
+    p[mlen] = '\0';
+
+    __atomic_store_n(&a->head, a->head + size, __ATOMIC_RELEASE);
+
+    a->queued++;
+
+    log_async_wakeup(a);
+
+    return true;
+}
+
+/* waits until the writer consumes all the records */
+static void log_async_flush(struct log_async *a)
+{
+    if (!a->running)
         return;
 
-    n = lua_gettop(L);
+    while (log_async_used(a) > 0) {
+        log_async_wakeup(a);
+        usleep(1000);
+    }
+}
 
-    for (i = 1; i <= n && room > 1; i++) {
-        int t = lua_type(L, i);
-        const char *s;
-        size_t len;
+static void log_async_stop(struct log_async *a)
+{
+    if (!a->running)
+        return;
+
+    __atomic_store_n(&a->stop, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&a->waiting, false, __ATOMIC_SEQ_CST);
+    sem_post(&a->wake);
+
+    pthread_join(a->tid, NULL);
+
+    sem_destroy(&a->wake);
+    sem_destroy(&a->space);
+    free(a->ring);
+
+    a->ring = NULL;
+    a->running = false;
+}
+
+static void log_async_atexit(void)
+{
+    log_async_stop(&log_async);
+}
+
+/* the writer thread doesn't exist in the child, which logs synchronously */
+static void log_async_atfork_child(void)
+{
+    log_async.running = false;
+    log_async.ring = NULL;
+}
+
+static int log_async_start(struct log_async *a, uint64_t size, int overflow)
+{
+    static bool registered;
+    sigset_t set, oldset;
+    int err;
+
+    a->ring = malloc(size);
+    if (!a->ring)
+        return ENOMEM;
+
+    a->size = size;
+    a->overflow = overflow;
+    a->head = a->tail = 0;
+    a->waiting = a->blocked = a->stop = false;
+    a->lost = 0;
+
+    sem_init(&a->wake, 0, 0);
+    sem_init(&a->space, 0, 0);
 
-        switch (t) {
-        case LUA_TSTRING:
-        case LUA_TNUMBER:
-            s = lua_tolstring(L, i, &len);
+    /* the signals are handled by the loop thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    err = pthread_create(&a->tid, NULL, log_async_thread, a);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err) {
+        sem_destroy(&a->wake);
+        sem_destroy(&a->space);
+        free(a->ring);
+        a->ring = NULL;
+        return err;
+    }
+
+    if (!registered) {
+        atexit(log_async_atexit);
+        pthread_atfork(NULL, NULL, log_async_atfork_child);
+        registered = true;
+    }
+
+    a->running = true;
+
+    return 0;
+}
+
+enum {
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_JSON,
+    LOG_FORMAT_LOGFMT
+};
+
+static int log_format = LOG_FORMAT_TEXT;
+
+/*
+ * A bounded writer, which stops at end. One byte beyond end is reserved
+ * for the closing character of a JSON object.
+ */
+struct log_buf {
+    char *pos;
+    char *end;
+    bool truncated;
+};
+
+static void log_buf_put(struct log_buf *b, const char *s, size_t len)
+{
+    size_t room = b->end - b->pos;
+
+    if (len > room) {
+        len = room;
+        b->truncated = true;
+    }
+
+    memcpy(b->pos, s, len);
+    b->pos += len;
+}
+
+static inline void log_buf_putc(struct log_buf *b, char c)
+{
+    log_buf_put(b, &c, 1);
+}
+
+/* the escape sequence of a character is never split by truncation */
+static void log_buf_put_escaped(struct log_buf *b, const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        char esc[7];
+        int elen = 2;
+
+        esc[0] = '\\';
+
+        switch (c) {
+        case '"':
+        case '\\':
+            esc[1] = c;
             break;
-        case LUA_TBOOLEAN:
-            if (lua_toboolean(L, i)) {
-                s = "true";
-                len = 4;
-            } else {
-                s = "false";
-                len = 5;
-            }
+        case '\n':
+            esc[1] = 'n';
+            break;
+        case '\r':
+            esc[1] = 'r';
             break;
-        case LUA_TNIL:
-            s = "nil";
-            len = 3;
+        case '\t':
+            esc[1] = 't';
             break;
         default:
+            if (c < 0x20) {
+                elen = snprintf(esc, sizeof(esc), "\\u%04x", c);
+            } else {
+                esc[0] = c;
+                elen = 1;
+            }
+            break;
+        }
+
+        if (elen > b->end - b->pos) {
+            b->truncated = true;
+            return;
+        }
+
+        memcpy(b->pos, esc, elen);
+        b->pos += elen;
+    }
+}
+
+/*
+ * The closing quote always fits once the opening one does, so a truncated
+ * string is still quoted. It returns false if nothing is written.
+ */
+static bool log_buf_put_quoted(struct log_buf *b, const char *s, size_t len)
+{
+    if (b->end - b->pos < 2) {
+        b->truncated = true;
+        return false;
+    }
+
+    *b->pos++ = '"';
+
+    b->end--;
+    log_buf_put_escaped(b, s, len);
+    b->end++;
+
+    *b->pos++ = '"';
+
+    return true;
+}
+
+static bool logfmt_need_quote(const char *s, size_t len)
+{
+    size_t i;
+
+    if (len == 0)
+        return true;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        if (c <= ' ' || c == '=' || c == '"' || c == '\\' || c == 0x7f)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * The parsers of logfmt don't accept quoted keys, so the characters which
+ * can't be in a bare key are replaced by '_'.
+ */
+static void log_put_key(struct log_buf *b, const char *key, size_t len)
+{
+    size_t i;
+
+    if (len == 0) {
+        log_buf_putc(b, '_');
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = key[i];
+
+        if (c <= ' ' || c == '=' || c == '"' || c == '\\' || c == 0x7f)
+            c = '_';
+
+        log_buf_putc(b, c);
+    }
+}
+
+/* converts a scalar value to a string without creating a Lua string */
+static const char *log_scalar(lua_State *L, int idx, char *tmp, size_t tmplen, size_t *len)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+        return lua_tolstring(L, idx, len);
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx))
+            *len = snprintf(tmp, tmplen, LUA_INTEGER_FMT, lua_tointeger(L, idx));
+        else
+            *len = snprintf(tmp, tmplen, LUAI_NUMFFORMAT, lua_tonumber(L, idx));
+        return tmp;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx)) {
+            *len = 4;
+            return "true";
+        }
+        *len = 5;
+        return "false";
+    case LUA_TNIL:
+        *len = 3;
+        return "nil";
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Writes the value at the top of the stack. It returns false if the value
+ * is truncated into an invalid token, which must be discarded.
+ */
+static bool log_put_value(lua_State *L, struct log_buf *b)
+{
+    int t = lua_type(L, -1);
+    bool pushed = false;
+    bool quote = false;
+    bool ok = true;
+    const char *s;
+    char tmp[64];
+    size_t len;
+
+    s = log_scalar(L, -1, tmp, sizeof(tmp), &len);
+    if (!s) {
+        s = luaL_tolstring(L, -1, &len);
+        pushed = true;
+    }
+
+    if (log_format == LOG_FORMAT_JSON) {
+        if (t == LUA_TNIL || (t == LUA_TNUMBER && !isfinite(lua_tonumber(L, -1)))) {
+            s = "null";
+            len = 4;
+        } else if (t != LUA_TNUMBER && t != LUA_TBOOLEAN) {
+            quote = true;
+        }
+    } else if (t != LUA_TNUMBER && t != LUA_TBOOLEAN && t != LUA_TNIL) {
+        quote = logfmt_need_quote(s, len);
+    }
+
+    if (quote) {
+        ok = log_buf_put_quoted(b, s, len);
+    } else {
+        log_buf_put(b, s, len);
+        ok = !b->truncated;
+    }
+
+    if (pushed)
+        lua_pop(L, 1);
+
+    return ok;
+}
+
+/*
+ * Appends the string keyed fields of the table at idx. A function value is
+ * called only here, i.e. after the level check, and its result is logged,
+ * or the error message if it fails. A field which doesn't fit is dropped.
+ */
+static void log_put_fields(lua_State *L, int idx, struct log_buf *b)
+{
+    lua_pushnil(L);
+
+    while (lua_next(L, idx)) {
+        char *saved = b->pos;
+        const char *key;
+        size_t klen;
+
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            lua_pop(L, 1);
             continue;
         }
 
-        if (i > 1) {
-            *pos++ = ' ';
-            room--;
+        key = lua_tolstring(L, -2, &klen);
+
+        if (lua_isfunction(L, -1))
+            lua_pcall(L, 0, 1, 0);
+
+        if (log_format == LOG_FORMAT_JSON) {
+            log_buf_put(b, ",", 1);
+            log_buf_put_quoted(b, key, klen);
+            log_buf_putc(b, ':');
+        } else {
+            log_buf_putc(b, ' ');
+            log_put_key(b, key, klen);
+            log_buf_putc(b, '=');
+        }
+
+        if (b->truncated || !log_put_value(L, b)) {
+            b->pos = saved;
+            lua_pop(L, 2);
+            break;
+        }
+
+        lua_pop(L, 1);
+
+        if (b->truncated) {
+            lua_pop(L, 1);
+            break;
+        }
+    }
+}
+
+/*
+ * Formats the arguments from first to the top of the stack into buf. The
+ * arguments are joined by a space as the message, and a table as the last
+ * argument holds the fields. Since
+ * it runs after the level check, the functions in the arguments and the
+ * fields are called only if the message is logged.
+ */
+static size_t log_format_message(lua_State *L, int first, char *buf, size_t size)
+{
+    struct log_buf b = {
+        .pos = buf,
+        .end = buf + size - 2,
+        .truncated = false
+    };
+    int fields = 0;
+    int n, i;
+
+    n = lua_gettop(L);
+
+    if (n >= first && lua_istable(L, n))
+        fields = n--;
+
+    if (log_format == LOG_FORMAT_JSON)
+        log_buf_put(&b, "{\"msg\":", 7);
+    else if (log_format == LOG_FORMAT_LOGFMT)
+        log_buf_put(&b, "msg=", 4);
+
+    if (log_format != LOG_FORMAT_TEXT) {
+        log_buf_putc(&b, '"');
+        b.end--;
+    }
+
+    for (i = first; i <= n && !b.truncated; i++) {
+        const char *s;
+        char tmp[64];
+        size_t len;
+
+        /* a function argument is called for the message lazily */
+        if (lua_isfunction(L, i)) {
+            lua_pushvalue(L, i);
+            lua_pcall(L, 0, 1, 0);
+            lua_replace(L, i);
+        }
+
+        s = log_scalar(L, i, tmp, sizeof(tmp), &len);
+        if (!s)
+            continue;
+
+        if (i > first)
+            log_buf_putc(&b, ' ');
+
+        if (log_format == LOG_FORMAT_TEXT)
+            log_buf_put(&b, s, len);
+        else
+            log_buf_put_escaped(&b, s, len);
+    }
+
+    if (log_format != LOG_FORMAT_TEXT) {
+        b.end++;
+        *b.pos++ = '"';
+    }
+
+    if (fields && !b.truncated)
+        log_put_fields(L, fields, &b);
+
+    if (log_format == LOG_FORMAT_JSON)
+        *b.pos++ = '}';
+
+    *b.pos = '\0';
+
+    return b.pos - buf;
+}
+
+#define LOG_SITES       256
+#define LOG_SITE_WAYS   4
+
+/*
+ * A token bucket per callsite, the callsites are identified by the source
+ * of the chunk and the line. A callsite is looked up in a set of ways, and
+ * when the set is full it takes over the least recently used slot with its
+ * bucket, so the colliding callsites are limited together rather than
+ * refilled by each other.
+ */
+struct log_site {
+    const char *source;
+    int line;
+    double tokens;
+    double last;
+    uint32_t suppressed;
+};
+
+static struct {
+    double rate;        /* messages per second of a callsite, 0 disables the limit */
+    double burst;
+    uint32_t sampling;  /* the threshold of the random number to log a debug message */
+    uint32_t seed;
+    uint64_t suppressed;
+    uint64_t sampled;
+    struct log_site sites[LOG_SITES];
+} log_limit = {
+    .sampling = UINT32_MAX,
+    .seed = 2463534242
+};
+
+static double log_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift32, enough to sample the messages */
+static inline uint32_t log_random(void)
+{
+    uint32_t x = log_limit.seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return log_limit.seed = x;
+}
+
+/*
+ * Takes a token from the bucket of the callsite. It returns false if the
+ * message must be suppressed, otherwise the number of the messages
+ * suppressed since the last one logged is stored in suppressed.
+ */
+static bool log_site_allow(const char *source, int line, uint32_t *suppressed)
+{
+    uintptr_t h = ((uintptr_t)source >> 4) ^ ((uintptr_t)line * 2654435761u);
+    struct log_site *set = &log_limit.sites[h % (LOG_SITES / LOG_SITE_WAYS) * LOG_SITE_WAYS];
+    struct log_site *site = NULL;
+    double now = log_now();
+    int i;
+
+    for (i = 0; i < LOG_SITE_WAYS; i++) {
+        if (set[i].source == source && set[i].line == line) {
+            site = &set[i];
+            break;
         }
 
-        if (len > room)
-            len = room;
+        if (!site || !set[i].source || (site->source && set[i].last < site->last))
+            site = &set[i];
+    }
+
+    if (!site->source) {
+        site->tokens = log_limit.burst;
+        site->last = now;
+        site->suppressed = 0;
+    }
+
+    site->source = source;
+    site->line = line;
+
+    site->tokens += (now - site->last) * log_limit.rate;
+    if (site->tokens > log_limit.burst)
+        site->tokens = log_limit.burst;
+    site->last = now;
+
+    if (site->tokens < 1.0) {
+        site->suppressed++;
+        log_limit.suppressed++;
+        return false;
+    }
+
+    site->tokens -= 1.0;
+
+    *suppressed = site->suppressed;
+    site->suppressed = 0;
+
+    return true;
+}
+
+static void log_emit(int priority, const char *filename, int line, const char *msg, size_t len)
+{
+    struct log_async *a = &log_async;
 
-        memcpy(pos, s, len);
-        pos += len;
-        room -= len;
+    if (!a->running) {
+        ___log(filename, line, priority, "%s", msg);
+        return;
     }
 
-    *pos = '\0';
+    if (!log_async_push(a, priority, filename, line, msg, len)) {
+        a->dropped++;
+        if (a->overflow == LOG_OVERFLOW_COUNT)
+            a->lost++;
+    }
+}
 
-    if (__log_flags__ & LOG_FLAG_FILE || __log_flags__ & LOG_FLAG_PATH) {
+static void __lua_log(lua_State *L, int priority)
+{
+    static char buf[BUFSIZ];
+    const char *filename = "";
+    uint32_t suppressed = 0;
+    bool site = false;
+    int line = -1;
+    lua_Debug ar;
+    size_t len;
+
+    priority = LOG_PRI(priority);
+
+    if (priority > __log_level__)
+        return;
+
+    if (priority == LOG_DEBUG && log_limit.sampling < UINT32_MAX && log_random() > log_limit.sampling) {
+        log_limit.sampled++;
+        return;
+    }
+
+    if (log_limit.rate > 0 || __log_flags__ & LOG_FLAG_FILE || __log_flags__ & LOG_FLAG_PATH) {
         if (lua_getstack(L, 1, &ar)) {
             lua_getinfo(L, "Sl", &ar);
-            if (ar.currentline > 0) {
-                filename = ar.short_src;
-                line = ar.currentline;
-            }
+            site = ar.currentline > 0;
         }
     }
 
-    ___log(filename, line, priority, "%s", buf);
+    if (log_limit.rate > 0 && site && !log_site_allow(ar.source, ar.currentline, &suppressed))
+        return;
+
+    if (site && (__log_flags__ & LOG_FLAG_FILE || __log_flags__ & LOG_FLAG_PATH)) {
+        filename = ar.short_src;
+        line = ar.currentline;
+    }
+
+    /*
+     * The number of the messages dropped by the full ring is queued ahead of
+     * the next message, until it fits. It's formatted as the message "dropped"
+     * with the field count, and attributed to the caller of the next message.
+     */
+    if (log_async.running && log_async.lost) {
+        int top = lua_gettop(L);
+
+        lua_pushliteral(L, "dropped");
+        lua_createtable(L, 0, 1);
+        lua_pushinteger(L, log_async.lost);
+        lua_setfield(L, -2, "count");
+
+        len = log_format_message(L, top + 1, buf, sizeof(buf));
+        if (log_async_push(&log_async, LOG_WARNING, filename, line, buf, len))
+            log_async.lost = 0;
+
+        lua_settop(L, top);
+    }
+
+    if (suppressed) {
+        int top = lua_gettop(L);
+
+        lua_pushliteral(L, "suppressed");
+        lua_createtable(L, 0, 1);
+        lua_pushinteger(L, suppressed);
+        lua_setfield(L, -2, "count");
+
+        len = log_format_message(L, top + 1, buf, sizeof(buf));
+        log_emit(priority, filename, line, buf, len);
+
+        lua_settop(L, top);
+    }
+
+    len = log_format_message(L, 1, buf, sizeof(buf));
+
+    log_emit(priority, filename, line, buf, len);
 }
 
 static int lua_log_debug(lua_State *L)
@@ -125,6 +856,9 @@ static int lua_log_set_path(lua_State *L)
 {
     const char *path = luaL_checkstring(L, 1);
 
+    /* the sink must not be changed while the writer uses it */
+    log_async_flush(&log_async);
+
     set_log_path(path);
 
     return 0;
@@ -134,6 +868,9 @@ static int lua_log_set_flags(lua_State *L)
 {
     int flags = lua_tointeger(L, 1);
 
+    /* the sink must not be changed while the writer uses it */
+    log_async_flush(&log_async);
+
     set_log_flags(flags);
 
     return 0;
@@ -143,11 +880,166 @@ static int lua_log_set_ident(lua_State *L)
 {
     const char *ident = luaL_checkstring(L, 1);
 
+    /* the sink must not be changed while the writer uses it */
+    log_async_flush(&log_async);
+
     set_log_ident(ident);
 
     return 0;
 }
 
+/*
+ * Limits the messages logged by each callsite to rate per second, with
+ * bursts of up to burst messages, which defaults to rate. The number of
+ * the suppressed messages is logged before the next message allowed, as
+ * the message "suppressed" with the field count.
+ * A rate of 0 or nil disables the limit.
+ */
+static int lua_log_set_rate_limit(lua_State *L)
+{
+    double rate = luaL_optnumber(L, 1, 0);
+    double burst = luaL_optnumber(L, 2, rate);
+
+    log_limit.rate = rate > 0 ? rate : 0;
+    log_limit.burst = burst < 1.0 ? 1.0 : burst;
+
+    memset(log_limit.sites, 0, sizeof(log_limit.sites));
+
+    return 0;
+}
+
+/* logs only the given ratio (0 to 1) of the debug messages, picked at random */
+static int lua_log_set_sampling(lua_State *L)
+{
+    double ratio = luaL_checknumber(L, 1);
+
+    if (ratio >= 1.0)
+        log_limit.sampling = UINT32_MAX;
+    else if (ratio <= 0)
+        log_limit.sampling = 0;
+    else
+        log_limit.sampling = ratio * UINT32_MAX;
+
+    return 0;
+}
+
+/*
+ * Sets the format of the messages:
+ * "text": the arguments joined by a space, followed by the fields as key=value, the default
+ * "json": {"msg":"the arguments","key":value,...}
+ * "logfmt": msg="the arguments" key=value ...
+ * In text and logfmt, the characters of a key which aren't allowed in a bare
+ * word, e.g. spaces and '=', are replaced by '_'.
+ */
+static int lua_log_set_format(lua_State *L)
+{
+    static const char *const formats[] = {"text", "json", "logfmt", NULL};
+
+    log_format = luaL_checkoption(L, 1, NULL, formats);
+
+    return 0;
+}
+
+/*
+ * Enables the asynchronous logging, or disables it if the argument is false.
+ * The messages are copied into a ring buffer, and written to the sink by a
+ * background thread, so the loop thread never waits for the sink.
+ * The options:
+ * size: the size of the ring buffer in bytes, rounded up to a power of 2
+ * overflow: what to do with a message if the ring is full
+ *   "drop": drops it, the default
+ *   "count": drops it, and logs how many messages are dropped ahead of the next
+ *            message queued, as the message "dropped" with the field count
+ *   "block": waits until the writer frees enough space
+ */
+static int lua_log_async(lua_State *L)
+{
+    static const char *const overflows[] = {"drop", "block", "count", NULL};
+    uint64_t size = LOG_ASYNC_DEFAULT_SIZE;
+    int overflow = LOG_OVERFLOW_DROP;
+    int err;
+
+    if (!lua_toboolean(L, 1)) {
+        log_async_stop(&log_async);
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "size");
+        if (!lua_isnil(L, -1)) {
+            lua_Integer n = luaL_checkinteger(L, -1);
+
+            if (n < LOG_ASYNC_MIN_SIZE)
+                n = LOG_ASYNC_MIN_SIZE;
+
+            for (size = LOG_ASYNC_MIN_SIZE; size < (uint64_t)n; size <<= 1)
+                ;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "overflow");
+        overflow = luaL_checkoption(L, -1, "drop", overflows);
+        lua_pop(L, 1);
+    }
+
+    /* restarts with the new options */
+    log_async_stop(&log_async);
+
+    err = log_async_start(&log_async, size, overflow);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/* waits until all the queued messages are written */
+static int lua_log_flush(lua_State *L)
+{
+    log_async_flush(&log_async);
+    return 0;
+}
+
+static int lua_log_stats(lua_State *L)
+{
+    struct log_async *a = &log_async;
+
+    lua_createtable(L, 0, 9);
+
+    lua_pushboolean(L, a->running);
+    lua_setfield(L, -2, "async");
+
+    lua_pushinteger(L, a->running ? a->size : 0);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, a->running ? log_async_used(a) : 0);
+    lua_setfield(L, -2, "used");
+
+    lua_pushinteger(L, a->queued);
+    lua_setfield(L, -2, "queued");
+
+    lua_pushinteger(L, __atomic_load_n(&a->written, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "written");
+
+    lua_pushinteger(L, a->dropped);
+    lua_setfield(L, -2, "dropped");
+
+    lua_pushinteger(L, a->blocks);
+    lua_setfield(L, -2, "blocked");
+
+    lua_pushinteger(L, log_limit.suppressed);
+    lua_setfield(L, -2, "suppressed");
+
+    lua_pushinteger(L, log_limit.sampled);
+    lua_setfield(L, -2, "sampled");
+
+    return 1;
+}
+
 static const luaL_Reg funcs[] = {
     {"set_level", lua_log_set_level},
     {"debug", lua_log_debug},
@@ -157,6 +1049,12 @@ static const luaL_Reg funcs[] = {
     {"set_path", lua_log_set_path},
     {"set_flags", lua_log_set_flags},
     {"set_ident", lua_log_set_ident},
+    {"set_format", lua_log_set_format},
+    {"set_rate_limit", lua_log_set_rate_limit},
+    {"set_sampling", lua_log_set_sampling},
+    {"async", lua_log_async},
+    {"flush", lua_log_flush},
+    {"stats", lua_log_stats},
     {NULL, NULL}
 };
 
@@ -38,10 +38,15 @@ struct eco_socket {
         size_t len;
         size_t sent;
         const void *data;
+        struct eco_file_mmap *mmap;
         union {
             struct {
                 int fd;
+                bool dontneed;
                 off_t offset;
+                off_t start;
+                off_t readahead;
+                off_t ra_end;
             };
             struct {
                 uint8_t addr[sizeof(struct sockaddr_un)];
@@ -460,21 +465,46 @@ static int lua_recvfrom(lua_State *L)
     return __lua_recv(L, true);
 }
 
-static inline int lua_init_snd(struct eco_socket *sock, lua_State *L)
+static inline int lua_init_snd(struct eco_socket *sock, lua_State *L, bool slice)
 {
+    struct eco_file_mmap *m;
+
     if (sock->snd.co) {
         lua_pushnil(L);
         lua_pushliteral(L, "busy");
         return -1;
     }
 
-    sock->snd.data = luaL_checklstring(L, 2, &sock->snd.len);
+    sock->snd.mmap = NULL;
+
+    /*
+     * The mapping is kept on the stack until the sending finished, and
+     * pinned so that closing it doesn't unmap the data under the sending.
+     */
+    if (slice && (m = luaL_testudata(L, 2, ECO_FILE_MMAP_MT))) {
+        size_t start;
+
+        sock->snd.len = eco_file_mmap_range(L, m, 3, &start);
+        sock->snd.data = m->addr + start;
+        sock->snd.mmap = m;
+        eco_file_mmap_pin(m);
+    } else
+        sock->snd.data = luaL_checklstring(L, 2, &sock->snd.len);
+
     sock->snd.sent = 0;
     sock->snd.addrlen = 0;
 
     return 0;
 }
 
+static void lua_send_done(struct eco_socket *sock)
+{
+    if (sock->snd.mmap) {
+        eco_file_mmap_unpin(sock->snd.mmap);
+        sock->snd.mmap = NULL;
+    }
+}
+
 static int lua_sendk(lua_State *L, int status, lua_KContext ctx)
 {
     struct eco_socket *sock = (struct eco_socket *)ctx;
@@ -505,6 +535,8 @@ again:
             lua_pushliteral(L, "closed");
         else
             lua_pushstring(L, strerror(errno));
+
+        lua_send_done(sock);
         return 2;
     }
 
@@ -516,6 +548,8 @@ again:
         return lua_sendk(L, 0, ctx);
     }
 
+    lua_send_done(sock);
+
     lua_pushinteger(L, sent);
     return 1;
 }
@@ -524,7 +558,7 @@ static int lua_send(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, ECO_SOCKET_MT);
 
-    if (lua_init_snd(sock, L))
+    if (lua_init_snd(sock, L, true))
         return 2;
 
     return lua_sendk(L, 0, (lua_KContext)sock);
@@ -534,7 +568,7 @@ static int lua_sendto(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, ECO_SOCKET_MT);
 
-    if (lua_init_snd(sock, L))
+    if (lua_init_snd(sock, L, false))
         return 2;
 
     sock->snd.addrlen = lua_args_to_sockaddr(sock, L, (struct sockaddr *)sock->snd.addr, 1);
@@ -542,6 +576,31 @@ static int lua_sendto(lua_State *L)
     return lua_sendk(L, 0, (lua_KContext)sock);
 }
 
+/*
+ * Drops the pages just sent from the page cache, and keeps the data
+ * ahead prefetched asynchronously.
+ */
+static void sendfile_advise(struct eco_socket *sock, size_t sent, size_t n)
+{
+    off_t pos = sock->snd.start + sent;
+
+    if (sock->snd.dontneed)
+        posix_fadvise(sock->snd.fd, pos, n, POSIX_FADV_DONTNEED);
+
+    pos += n;
+
+    /* prefetch in steps of half of the window */
+    if (sock->snd.readahead > 0 && pos + sock->snd.readahead / 2 > sock->snd.ra_end) {
+        off_t end = pos + sock->snd.readahead;
+
+        if (sock->snd.ra_end < pos)
+            sock->snd.ra_end = pos;
+
+        posix_fadvise(sock->snd.fd, sock->snd.ra_end, end - sock->snd.ra_end, POSIX_FADV_WILLNEED);
+        sock->snd.ra_end = end;
+    }
+}
+
 static int lua_sendfilek(lua_State *L, int status, lua_KContext ctx)
 {
     struct eco_socket *sock = (struct eco_socket *)ctx;
@@ -577,6 +636,9 @@ again:
         return 2;
     }
 
+    if (ret > 0)
+        sendfile_advise(sock, sent, ret);
+
     sent += ret;
 
     if (ret && sent < len) {
@@ -604,7 +666,7 @@ static int lua_sendfile(lua_State *L)
 
     path = luaL_checkstring(L, 2);
 
-    fd = open(path, O_RDONLY);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
@@ -615,6 +677,31 @@ static int lua_sendfile(lua_State *L)
     sock->snd.fd = fd;
     sock->snd.len = luaL_checkinteger(L, 3);
     sock->snd.offset = luaL_optinteger(L, 4, -1);
+    /* without offset, it sends from the current position of the file */
+    sock->snd.start = sock->snd.offset < 0 ? lseek(fd, 0, SEEK_CUR) : sock->snd.offset;
+    if (sock->snd.start < 0)
+        sock->snd.start = 0;
+    sock->snd.dontneed = false;
+    sock->snd.readahead = 0;
+    sock->snd.ra_end = 0;
+
+    /* the access pattern hints */
+    if (lua_istable(L, 5)) {
+        lua_getfield(L, 5, "sequential");
+        if (lua_toboolean(L, -1))
+            posix_fadvise(fd, sock->snd.start, sock->snd.len, POSIX_FADV_SEQUENTIAL);
+
+        lua_getfield(L, 5, "dontneed");
+        sock->snd.dontneed = lua_toboolean(L, -1);
+
+        lua_getfield(L, 5, "readahead");
+        sock->snd.readahead = lua_tointeger(L, -1);
+
+        lua_pop(L, 3);
+
+        if (sock->snd.readahead > 0)
+            sendfile_advise(sock, 0, 0);
+    }
 
     return lua_sendfilek(L, 0, (lua_KContext)sock);
 }
@@ -803,6 +890,25 @@ static int lua_closed(lua_State *L)
     return 1;
 }
 
+/*
+ * Shuts down the connection, how defaults to SHUT_RDWR. Unlike close, the
+ * reading and writing in progress are woken up and fail.
+ */
+static int lua_shutdown(lua_State *L)
+{
+    struct eco_socket *sock = luaL_checkudata(L, 1, ECO_SOCKET_MT);
+    int how = luaL_optinteger(L, 2, SHUT_RDWR);
+
+    if (shutdown(sock->fd, how)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
 static int lua_sock_close(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, ECO_SOCKET_MT);
@@ -845,6 +951,7 @@ static const luaL_Reg methods[] = {
     {"setoption", lua_setoption},
     {"getfd", lua_getfd},
     {"closed", lua_closed},
+    {"shutdown", lua_shutdown},
     {"close", lua_sock_close},
     {"__gc", lua_sock_close},
     {NULL, NULL}
@@ -988,6 +1095,10 @@ int luaopen_eco_core_socket(lua_State *L)
     lua_add_constant(L, "SOCK_STREAM", SOCK_STREAM);
     lua_add_constant(L, "SOCK_RAW", SOCK_RAW);
 
+    lua_add_constant(L, "SHUT_RD", SHUT_RD);
+    lua_add_constant(L, "SHUT_WR", SHUT_WR);
+    lua_add_constant(L, "SHUT_RDWR", SHUT_RDWR);
+
     lua_add_constant(L, "IPPROTO_ICMP", IPPROTO_ICMP);
     lua_add_constant(L, "IPPROTO_ICMPV6", IPPROTO_ICMPV6);
 
@@ -24,6 +24,10 @@ function methods:closed()
     self.sock:closed()
 end
 
+function methods:shutdown(how)
+    return self.sock:shutdown(how)
+end
+
 function methods:setoption(name, value)
     return self.sock:setoption(name, value)
 end
@@ -74,8 +78,12 @@ function methods:accept()
     return setmetatable({ sock = sock, domain = self.domain, b = b }, metatable), perr
 end
 
-function methods:send(data)
-    return self.sock:send(data)
+--[[
+    data is a string, or a mapped file(see file.mmap) which is sent without
+    copying, the optional i and j select the range of it as string.sub does.
+--]]
+function methods:send(data, i, j)
+    return self.sock:send(data, i, j)
 end
 
 function methods:write(data)
@@ -86,8 +94,16 @@ function methods:sendto(data, ...)
     return self.sock:sendto(data, ...)
 end
 
-function methods:sendfile(path, len, offset)
-    return self.sock:sendfile(path, len, offset)
+--[[
+    Sends len bytes of the file from offset, which defaults to the beginning.
+
+    hints is an optional Table of the access pattern of the file:
+    sequential: a boolean flag controls whether to advise the kernel of sequential reading
+    dontneed: a boolean flag controls whether to drop the pages sent from the page cache
+    readahead: the bytes to prefetch ahead of the position sent asynchronously
+--]]
+function methods:sendfile(path, len, offset, hints)
+    return self.sock:sendfile(path, len, offset, hints)
 end
 
 --[[
@@ -144,6 +160,20 @@ function methods:discard(n, timeout)
     return self.b:discard(n, timeout)
 end
 
+--[[
+  Reads a body encoded with the HTTP chunked transfer coding.
+  Returns the decoded data, followed by `true` and a table of the trailer
+  fields once the whole body has been read.
+--]]
+function methods:recvchunked(timeout, limit)
+    assert(self.domain == socket.SOCK_STREAM)
+    return self.b:readchunked(timeout, limit)
+end
+
+function methods:readchunked(timeout, limit)
+    return self:recvchunked(timeout, limit)
+end
+
 function methods:recvfrom(n, timeout)
     return self.sock:recvfrom(n, timeout)
 end
@@ -126,6 +126,18 @@ function cli_methods:discard(n, timeout)
     return self.b:discard(n, timeout)
 end
 
+function cli_methods:recvchunked(timeout, limit)
+    return self.b:readchunked(timeout, limit)
+end
+
+function cli_methods:readchunked(timeout, limit)
+    return self:recvchunked(timeout, limit)
+end
+
+function cli_methods:shutdown(how)
+    return self.sock:shutdown(how)
+end
+
 function cli_methods:close()
     self.ssock:free()
 
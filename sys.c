@@ -3,9 +3,16 @@
  * Author: Jianhui Zhao <zhaojh329@gmail.com>
  */
 
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <sys/sysinfo.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 #include <stdbool.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <spawn.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -52,83 +59,357 @@ static int eco_sys_kill(lua_State *L)
     return 1;
 }
 
+#define ECO_SYS_CHILD_MT "eco{sys-child}"
+
+/*
+ * Records the exit status of a child from the moment it's created. libev
+ * reaps every child on SIGCHLD, and the status of a child without an
+ * active watcher is dropped, so a child exited before an eco.CHILD watcher
+ * waits for it would never be waited.
+ */
+struct eco_sys_child {
+    struct ev_child w;
+    struct eco_context *ctx;
+    bool active;
+};
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+/* the file actions to change the directory appeared in glibc 2.29 */
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 29)
+#define ECO_SPAWN_NO_CHDIR
+#endif
+
+/* and the one to close the inherited descriptors in glibc 2.34 */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+#define ECO_SPAWN_CLOSEFROM
+#endif
+
+/*
+ * Opens a pidfd of the child just created. The child isn't reaped until
+ * libev handles SIGCHLD in the loop, so the pidfd always refers to it.
+ */
+static void push_pidfd(lua_State *L, pid_t pid)
+{
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (pidfd < 0)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, pidfd);
+}
+
+/*
+ * Builds the environment of the child into a table at the top of the stack,
+ * which keeps the strings alive, and stores the pointers into envp. The
+ * variables in the table at idx override the inherited ones, and false
+ * removes one.
+ */
+static char **exec_build_env(lua_State *L, int idx)
+{
+    char **envp;
+    int n = 0, i;
+    int t;
+
+    for (i = 0; environ[i]; i++)
+        n++;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        n++;
+        lua_pop(L, 1);
+    }
+
+    envp = malloc(sizeof(char *) * (n + 1));
+    if (!envp)
+        return NULL;
+
+    lua_newtable(L);
+    t = lua_gettop(L);
+
+    n = 0;
+
+    for (i = 0; environ[i]; i++) {
+        const char *eq = strchr(environ[i], '=');
+        bool overridden;
+
+        if (!eq)
+            continue;
+
+        lua_pushlstring(L, environ[i], eq - environ[i]);
+        overridden = lua_rawget(L, idx) != LUA_TNIL;
+        lua_pop(L, 1);
+
+        if (!overridden)
+            envp[n++] = environ[i];
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) != LUA_TBOOLEAN) {
+            const char *value = luaL_tolstring(L, -1, NULL);
+
+            lua_pushfstring(L, "%s=%s", lua_tostring(L, -3), value);
+            envp[n++] = (char *)lua_tostring(L, -1);
+            lua_rawseti(L, t, n);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    envp[n] = NULL;
+
+    return envp;
+}
+
+/*
+ * Executes a program with posix_spawn, which doesn't copy the address space of
+ * the parent, so the cost doesn't grow with the size of the Lua heap. The
+ * stdout and stderr of the child are redirected to pipes.
+ *
+ * The arguments are the program, which is searched in PATH, and its arguments.
+ * The optional table as the last argument supports the following fields:
+ * env: a table of the environment variables to set, false removes one
+ * cwd: the working directory of the child
+ * stdin: true to write the stdin of the child through a pipe
+ * fds: a table maps the descriptors of the child to the ones of the parent,
+ *      e.g. {[1] = fd}, a mapped stdout or stderr isn't redirected to a pipe
+ *
+ * The other descriptors of the parent are not inherited, as the ones
+ * opened by eco are close-on-exec.
+ *
+ * It returns the pid, the read end of stdout and stderr, the write end of
+ * stdin, each is nil if not piped, and a pidfd of the child, which is nil
+ * if the kernel doesn't support it.
+ */
+struct exec_dup {
+    int src;
+    int dst;
+    bool tmp;   /* src is a temporary duplicate, closed after spawning */
+};
+
 static int eco_sys_exec(lua_State *L)
 {
-    const char *cmd = luaL_checkstring(L, 1);
+    int pipes[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+    bool piped[3] = {false, true, true};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    char **envp = environ;
+    const char *cwd = NULL;
     int n = lua_gettop(L);
-    int opipe[2] = {};
-    int epipe[2] = {};
+    struct exec_dup *dups = NULL;
+    char **argv = NULL;
+    int ndup = 0;
+    int nfds = 0;
+    int opts = 0;
+    int maxfd = 2;
+    sigset_t set;
     pid_t pid;
+    int err, i, j;
+
+    luaL_checkstring(L, 1);
+
+    if (n > 1 && lua_istable(L, n))
+        opts = n--;
+
+    for (i = 2; i <= n; i++)
+        luaL_checkstring(L, i);
+
+    if (opts) {
+        lua_getfield(L, opts, "cwd");
+        cwd = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+#ifdef ECO_SPAWN_NO_CHDIR
+        if (cwd)
+            return luaL_argerror(L, opts, "cwd is not supported");
+#endif
+
+        lua_getfield(L, opts, "stdin");
+        piped[0] = lua_toboolean(L, -1);
+        lua_pop(L, 1);
 
-    if (pipe(opipe) < 0 || pipe(epipe) < 0)
+        lua_getfield(L, opts, "fds");
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                int target = lua_tointeger(L, -2);
+
+                if (!lua_isinteger(L, -2) || target < 0 || !lua_isinteger(L, -1))
+                    return luaL_argerror(L, opts, "invalid fds");
+
+                if (target < 3)
+                    piped[target] = false;
+                else if (target > maxfd)
+                    maxfd = target;
+
+                nfds++;
+                lua_pop(L, 1);
+            }
+        }
+
+        lua_getfield(L, opts, "env");
+        if (lua_istable(L, -1)) {
+            envp = exec_build_env(L, lua_gettop(L));
+            if (!envp) {
+                err = ENOMEM;
+                goto err;
+            }
+        }
+    }
+
+    argv = malloc(sizeof(char *) * (n + 1));
+    if (!argv) {
+        err = ENOMEM;
         goto err;
+    }
 
-    pid = fork();
-    if (pid < 0) {
+    for (i = 0; i < n; i++)
+        argv[i] = (char *)lua_tostring(L, i + 1);
+    argv[n] = NULL;
+
+    dups = malloc(sizeof(struct exec_dup) * (nfds + 3));
+    if (!dups) {
+        err = ENOMEM;
         goto err;
-    } else if (pid == 0) {
-        const char **args;
-        int i, j;
-
-        /* close unused read end */
-        close(opipe[0]);
-        close(epipe[0]);
-
-        /* redirect */
-        dup2(opipe[1], STDOUT_FILENO);
-        dup2(epipe[1], STDERR_FILENO);
-        close(opipe[1]);
-        close(epipe[1]);
-
-        args = malloc(sizeof(char *) * 2);
-        if (!args)
-            exit(1);
-
-        args[0] = cmd;
-        args[1] = NULL;
-
-        j = 1;
-
-        for (i = 2; i <= n; i++) {
-            const char **tmp = realloc(args, sizeof(char *) * (2 + j));
-            if (!tmp)
-                exit(1);
-            args = tmp;
-            args[j++] = lua_tostring(L, i);
-            args[j] = NULL;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (piped[i] && pipe2(pipes[i], O_CLOEXEC) < 0) {
+            err = errno;
+            goto err;
         }
+    }
 
-        execvp(cmd, (char *const *)args);
+    /* the write end of stdin in the parent is written asynchronously */
+    if (piped[0])
+        fcntl(pipes[0][1], F_SETFL, fcntl(pipes[0][1], F_GETFL) | O_NONBLOCK);
 
-        fprintf(stderr, "%s: %s", cmd, strerror(errno));
-        free(args);
-        exit(127);
-    } else {
-        /* close unused write end */
-        close(opipe[1]);
-        close(epipe[1]);
+    for (i = 0; i < 3; i++) {
+        if (piped[i])
+            dups[ndup++] = (struct exec_dup){ i ? pipes[i][1] : pipes[i][0], i, false };
+    }
 
-        lua_pushinteger(L, pid);
-        lua_pushinteger(L, opipe[0]);
-        lua_pushinteger(L, epipe[0]);
+    if (opts && lua_istable(L, n + 2)) {
+        lua_pushnil(L);
+        while (lua_next(L, n + 2)) {
+            dups[ndup++] = (struct exec_dup){ lua_tointeger(L, -1), lua_tointeger(L, -2), false };
+            lua_pop(L, 1);
+        }
+    }
+
+    /*
+     * The dups run in order, so a source which is the target of an earlier one
+     * would be clobbered, e.g. {[1] = w, [2] = 1}. Such a source is duplicated
+     * above all the targets first.
+     */
+    for (i = 0; i < ndup; i++) {
+        for (j = 0; j < i && dups[j].dst != dups[i].src; j++)
+            ;
+
+        if (j == i)
+            continue;
 
-        return 3;
+        dups[i].src = fcntl(dups[i].src, F_DUPFD_CLOEXEC, maxfd + 1);
+        if (dups[i].src < 0) {
+            err = errno;
+            goto err;
+        }
+
+        dups[i].tmp = true;
     }
 
-err:
-    lua_pushnil(L);
-    lua_pushstring(L, strerror(errno));
+    posix_spawn_file_actions_init(&actions);
 
-    if (opipe[0] > 0) {
-        close(opipe[0]);
-        close(opipe[1]);
+    for (i = 0; i < ndup; i++)
+        posix_spawn_file_actions_adddup2(&actions, dups[i].src, dups[i].dst);
+
+#ifdef ECO_SPAWN_CLOSEFROM
+    posix_spawn_file_actions_addclosefrom_np(&actions, maxfd + 1);
+#endif
+
+#ifndef ECO_SPAWN_NO_CHDIR
+    if (cwd)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#endif
+
+    /* the child starts with the default signal handling, e.g. SIGPIPE is ignored by eco */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigfillset(&set);
+    posix_spawnattr_setsigdefault(&attr, &set);
+
+    err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err)
+        goto err;
+
+    for (i = 0; i < ndup; i++) {
+        if (dups[i].tmp)
+            close(dups[i].src);
+    }
+
+    free(dups);
+    free(argv);
+
+    if (envp != environ)
+        free(envp);
+
+    lua_pushinteger(L, pid);
+
+    for (i = 1; i < 3; i++) {
+        if (piped[i]) {
+            close(pipes[i][1]);
+            lua_pushinteger(L, pipes[i][0]);
+        } else {
+            lua_pushnil(L);
+        }
+    }
+
+    if (piped[0]) {
+        close(pipes[0][0]);
+        lua_pushinteger(L, pipes[0][1]);
+    } else {
+        lua_pushnil(L);
     }
 
-    if (epipe[0] > 0) {
-        close(epipe[0]);
-        close(epipe[1]);
+    push_pidfd(L, pid);
+
+    return 5;
+
+err:
+    for (i = 0; i < ndup; i++) {
+        if (dups[i].tmp)
+            close(dups[i].src);
     }
 
+    free(dups);
+    free(argv);
+
+    if (envp != environ)
+        free(envp);
+
+    for (i = 0; i < 3; i++) {
+        if (pipes[i][0] > -1) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+    }
+
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+
     return 2;
 }
 
@@ -151,6 +432,8 @@ static int eco_sys_spawn(lua_State *L)
 
         prctl(PR_SET_PDEATHSIG, SIGKILL);
 
+        /* the backend and the wakeup descriptors of the loop mustn't be shared with the parent */
+        ev_loop_fork(ctx->loop);
         ev_break(ctx->loop, 0);
 
         lua_getglobal(L, "eco");
@@ -174,6 +457,417 @@ err:
     return 1;
 }
 
+static int eco_sys_pidfd_open(lua_State *L)
+{
+    int pid = luaL_checkinteger(L, 1);
+    int fd;
+
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+/*
+ * Sends a signal to the process referred by the pidfd. Unlike kill, it never
+ * signals another process which reuses the pid after the child is reaped.
+ */
+static int eco_sys_pidfd_send_signal(lua_State *L)
+{
+    int pidfd = luaL_checkinteger(L, 1);
+    int sig = luaL_checkinteger(L, 2);
+
+    if (syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) < 0) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static void eco_sys_child_cb(struct ev_loop *loop, struct ev_child *w, int revents)
+{
+    struct eco_sys_child *c = container_of(w, struct eco_sys_child, w);
+
+    ev_ref(loop);
+    ev_child_stop(loop, w);
+    c->active = false;
+}
+
+/*
+ * Tracks the child, it doesn't keep the loop running. Since a child isn't
+ * reaped until libev handles SIGCHLD in the loop, it must be called right
+ * after the child is created.
+ */
+static int eco_sys_child(lua_State *L)
+{
+    int pid = luaL_checkinteger(L, 1);
+    struct eco_sys_child *c;
+
+    c = lua_newuserdata(L, sizeof(struct eco_sys_child));
+    luaL_setmetatable(L, ECO_SYS_CHILD_MT);
+
+    c->ctx = eco_get_context(L);
+    c->active = true;
+
+    ev_child_init(&c->w, eco_sys_child_cb, pid, 0);
+    ev_child_start(c->ctx->loop, &c->w);
+    ev_unref(c->ctx->loop);
+
+    return 1;
+}
+
+/* returns the pid and a table as the eco.CHILD watcher does, or nil if the child is running */
+static int eco_sys_child_status(lua_State *L)
+{
+    struct eco_sys_child *c = luaL_checkudata(L, 1, ECO_SYS_CHILD_MT);
+    int status = c->w.rstatus;
+
+    if (c->active || !c->w.rpid) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, c->w.rpid);
+
+    lua_newtable(L);
+
+    if (WIFEXITED(status)) {
+        lua_pushboolean(L, true);
+        lua_setfield(L, -2, "exited");
+
+        status = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        lua_pushboolean(L, true);
+        lua_setfield(L, -2, "signaled");
+
+        status = WTERMSIG(status);
+    }
+
+    lua_pushinteger(L, status);
+    lua_setfield(L, -2, "status");
+
+    return 2;
+}
+
+static int eco_sys_child_gc(lua_State *L)
+{
+    struct eco_sys_child *c = luaL_checkudata(L, 1, ECO_SYS_CHILD_MT);
+
+    if (c->active) {
+        ev_ref(c->ctx->loop);
+        ev_child_stop(c->ctx->loop, &c->w);
+        c->active = false;
+    }
+
+    return 0;
+}
+
+static const luaL_Reg child_methods[] = {
+    {"status", eco_sys_child_status},
+    {"__gc", eco_sys_child_gc},
+    {NULL, NULL}
+};
+
+static double timeval_to_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/*
+ * Returns the resource usage of the calling process, its terminated and
+ * waited children, or the calling thread: who is 'self', 'children' or
+ * 'thread', defaults to 'self'. The CPU times are in seconds and maxrss
+ * is in bytes.
+ */
+static int eco_sys_rusage(lua_State *L)
+{
+    static const char *const whos[] = {"self", "children", "thread", NULL};
+    static const int values[] = {RUSAGE_SELF, RUSAGE_CHILDREN, RUSAGE_THREAD};
+    int who = values[luaL_checkoption(L, 1, "self", whos)];
+    struct rusage ru;
+
+    if (getrusage(who, &ru)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_createtable(L, 0, 9);
+
+    lua_pushnumber(L, timeval_to_sec(&ru.ru_utime));
+    lua_setfield(L, -2, "utime");
+
+    lua_pushnumber(L, timeval_to_sec(&ru.ru_stime));
+    lua_setfield(L, -2, "stime");
+
+    lua_pushinteger(L, (lua_Integer)ru.ru_maxrss * 1024);
+    lua_setfield(L, -2, "maxrss");
+
+    lua_pushinteger(L, ru.ru_minflt);
+    lua_setfield(L, -2, "minflt");
+
+    lua_pushinteger(L, ru.ru_majflt);
+    lua_setfield(L, -2, "majflt");
+
+    lua_pushinteger(L, ru.ru_nvcsw);
+    lua_setfield(L, -2, "nvcsw");
+
+    lua_pushinteger(L, ru.ru_nivcsw);
+    lua_setfield(L, -2, "nivcsw");
+
+    lua_pushinteger(L, ru.ru_inblock);
+    lua_setfield(L, -2, "inblock");
+
+    lua_pushinteger(L, ru.ru_oublock);
+    lua_setfield(L, -2, "oublock");
+
+    return 1;
+}
+
+#define PROCSTAT_BUF_SIZE 4096
+
+/* reads a file under the /proc/<pid> directory into buf, which is always terminated */
+static ssize_t procstat_read(int dirfd, const char *name, char *buf)
+{
+    ssize_t len = 0;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    while (len < PROCSTAT_BUF_SIZE - 1) {
+        ssize_t n = read(fd, buf + len, PROCSTAT_BUF_SIZE - 1 - len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        len += n;
+    }
+
+    close(fd);
+
+    buf[len] = '\0';
+
+    return len;
+}
+
+/* parses the value of a "Key:  value [kB]" line, the unit kB is converted to bytes */
+static bool procstat_field(const char *line, const char *key, size_t keylen, lua_Integer *val)
+{
+    char *end;
+
+    if (strncmp(line, key, keylen) || line[keylen] != ':')
+        return false;
+
+    *val = strtoll(line + keylen + 1, &end, 10);
+
+    while (*end == ' ')
+        end++;
+
+    if (end[0] == 'k' && end[1] == 'B')
+        *val *= 1024;
+
+    return true;
+}
+
+/* scans the "Key: value" lines of buf for the keys, and sets the fields of the table on top */
+static void procstat_fields(lua_State *L, const char *buf, const char *const keys[][2])
+{
+    const char *line = buf;
+
+    while (*line) {
+        const char *next = strchr(line, '\n');
+        lua_Integer val;
+        int i;
+
+        for (i = 0; keys[i][0]; i++) {
+            if (procstat_field(line, keys[i][0], strlen(keys[i][0]), &val)) {
+                lua_pushinteger(L, val);
+                lua_setfield(L, -2, keys[i][1]);
+                break;
+            }
+        }
+
+        if (!next)
+            break;
+
+        line = next + 1;
+    }
+}
+
+static int procstat_count_fds(int dirfd)
+{
+    struct dirent *e;
+    int count = 0;
+    DIR *dir;
+    int fd;
+
+    fd = openat(dirfd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] != '.')
+            count++;
+    }
+
+    closedir(dir);
+
+    return count;
+}
+
+static const char *const procstat_status_keys[][2] = {
+    {"VmRSS", "rss"},
+    {"VmHWM", "maxrss"},
+    {"VmSize", "vsize"},
+    {"RssAnon", "rss_anon"},
+    {"RssFile", "rss_file"},
+    {"RssShmem", "rss_shmem"},
+    {"Threads", "threads"},
+    {"voluntary_ctxt_switches", "nvcsw"},
+    {"nonvoluntary_ctxt_switches", "nivcsw"},
+    {NULL, NULL}
+};
+
+static const char *const procstat_smaps_keys[][2] = {
+    {"Pss", "pss"},
+    {"Swap", "swap"},
+    {NULL, NULL}
+};
+
+static const char *const procstat_io_keys[][2] = {
+    {"rchar", "rchar"},
+    {"wchar", "wchar"},
+    {"read_bytes", "read_bytes"},
+    {"write_bytes", "write_bytes"},
+    {"cancelled_write_bytes", "cancelled_write_bytes"},
+    {NULL, NULL}
+};
+
+/*
+ * Reads the metrics of a process from /proc, pid defaults to the calling
+ * process. The files are read into a fixed buffer through a descriptor of
+ * the /proc/<pid> directory, so all of them belong to the same process even
+ * if the pid is reused meanwhile, which makes the reading fail with ESRCH.
+ *
+ * The CPU times are in seconds and the sizes are in bytes. The fields of
+ * the files not accessible, e.g. io of a process of another user, are absent.
+ * pss and swap come from smaps_rollup, which walks all the mappings of the
+ * process, set the second argument to false to skip it.
+ */
+static int eco_sys_procstat(lua_State *L)
+{
+    pid_t pid = luaL_optinteger(L, 1, 0);
+    bool pss = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    unsigned long long utime, stime, starttime;
+    unsigned long minflt, majflt;
+    long clk_tck = sysconf(_SC_CLK_TCK);
+    char buf[PROCSTAT_BUF_SIZE];
+    char state;
+    char *p;
+    int dirfd;
+    int fds;
+    int err;
+
+    if (pid > 0) {
+        snprintf(buf, sizeof(buf), "/proc/%d", pid);
+        dirfd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        dirfd = open("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    if (dirfd < 0)
+        goto err;
+
+    if (procstat_read(dirfd, "stat", buf) < 0)
+        goto err;
+
+    /* the comm field may contain spaces and parentheses */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %llu %llu %*d %*d %*d %*d %*d %*d %llu",
+            &state, &minflt, &majflt, &utime, &stime, &starttime) != 6) {
+        close(dirfd);
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid stat");
+        return 2;
+    }
+
+    lua_createtable(L, 0, 24);
+
+    lua_pushlstring(L, &state, 1);
+    lua_setfield(L, -2, "state");
+
+    lua_pushnumber(L, (double)utime / clk_tck);
+    lua_setfield(L, -2, "utime");
+
+    lua_pushnumber(L, (double)stime / clk_tck);
+    lua_setfield(L, -2, "stime");
+
+    /* seconds since boot */
+    lua_pushnumber(L, (double)starttime / clk_tck);
+    lua_setfield(L, -2, "starttime");
+
+    lua_pushinteger(L, minflt);
+    lua_setfield(L, -2, "minflt");
+
+    lua_pushinteger(L, majflt);
+    lua_setfield(L, -2, "majflt");
+
+    if (procstat_read(dirfd, "status", buf) < 0)
+        goto err_table;
+
+    procstat_fields(L, buf, procstat_status_keys);
+
+    if (pss && procstat_read(dirfd, "smaps_rollup", buf) >= 0)
+        procstat_fields(L, buf, procstat_smaps_keys);
+
+    if (procstat_read(dirfd, "io", buf) >= 0)
+        procstat_fields(L, buf, procstat_io_keys);
+
+    fds = procstat_count_fds(dirfd);
+    if (fds >= 0) {
+        lua_pushinteger(L, fds);
+        lua_setfield(L, -2, "fds");
+    }
+
+    close(dirfd);
+
+    return 1;
+
+err_table:
+    lua_pop(L, 1);
+err:
+    err = errno;
+
+    if (dirfd >= 0)
+        close(dirfd);
+
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+}
+
 static int eco_sys_get_nprocs(lua_State *L)
 {
     int nprocs = get_nprocs();
@@ -198,6 +892,11 @@ static const luaL_Reg funcs[] = {
     {"kill", eco_sys_kill},
     {"exec", eco_sys_exec},
     {"spawn", eco_sys_spawn},
+    {"child", eco_sys_child},
+    {"pidfd_open", eco_sys_pidfd_open},
+    {"pidfd_send_signal", eco_sys_pidfd_send_signal},
+    {"rusage", eco_sys_rusage},
+    {"procstat", eco_sys_procstat},
     {"get_nprocs", eco_sys_get_nprocs},
     {"strerror", eco_sys_strerror},
     {NULL, NULL}
@@ -205,6 +904,9 @@ static const luaL_Reg funcs[] = {
 
 int luaopen_eco_core_sys(lua_State *L)
 {
+    eco_new_metatable(L, ECO_SYS_CHILD_MT, child_methods);
+    lua_pop(L, 1);
+
     luaL_newlib(L, funcs);
 
     /* signal */
@@ -4,46 +4,147 @@
 local file = require 'eco.core.file'
 local sys = require 'eco.core.sys'
 local bufio = require 'eco.bufio'
+local sync = require 'eco.sync'
+local time = require 'eco.time'
 
 local M = {}
 
 local exec_methods = {}
 
-function exec_methods:release()
-    if not self.stdout_fd then
+function exec_methods:close_stdin()
+    if not self.stdin_fd then
         return
     end
 
-    file.close(self.stdout_fd)
-    file.close(self.stderr_fd)
+    self.stdin_w:cancel()
+    file.close(self.stdin_fd)
 
-    self.stdout_fd = nil
-    self.stderr_fd = nil
+    self.stdin_fd = nil
+end
+
+function exec_methods:release()
+    self:close_stdin()
+
+    if self.pidfd then
+        file.close(self.pidfd)
+        self.pidfd = nil
+    end
+
+    if self.stdout_fd then
+        file.close(self.stdout_fd)
+        self.stdout_fd = nil
+    end
+
+    if self.stderr_fd then
+        file.close(self.stderr_fd)
+        self.stderr_fd = nil
+    end
 end
 
 function exec_methods:wait(timeout)
+    local pid, status = self.child:status()
+    if pid then
+        return pid, status
+    end
+
     return self.child_w:wait(timeout or 30.0)
 end
 
+--[[
+    Sends a signal, defaults to SIGTERM, to the child. With a pidfd, it never
+    signals another process which reuses the pid after the child is waited.
+--]]
+function exec_methods:kill(sig)
+    sig = sig or sys.SIGTERM
+
+    if self.pidfd then
+        return sys.pidfd_send_signal(self.pidfd, sig)
+    end
+
+    return sys.kill(self.__pid, sig)
+end
+
 function exec_methods:pid()
     return self.__pid
 end
 
+--[[
+    Returns the metrics of the child, see sys.procstat. It fails once the
+    child is waited. With a pidfd, the metrics of another process which
+    reuses the pid are never returned.
+--]]
+function exec_methods:procstat(pss)
+    local st, err = sys.procstat(self.__pid, pss)
+    if not st then
+        return nil, err
+    end
+
+    if self.pidfd and not sys.pidfd_send_signal(self.pidfd, 0) then
+        return nil, 'exited'
+    end
+
+    return st
+end
+
 function exec_methods:read_stdout(pattern, timeout)
+    if not self.stdout_b then
+        return nil, 'not piped'
+    end
+
     return self.stdout_b:read(pattern, timeout)
 end
 
 function exec_methods:read_stderr(pattern, timeout)
+    if not self.stderr_b then
+        return nil, 'not piped'
+    end
+
     return self.stderr_b:read(pattern, timeout)
 end
 
+local EAGAIN = sys.strerror(sys.EAGAIN)
+
+-- writes data to the stdin of the child, which must be executed with the stdin option
+function exec_methods:write_stdin(data, timeout)
+    if not self.stdin_fd then
+        return nil, 'not piped'
+    end
+
+    local total = #data
+    local sent = 0
+
+    while sent < total do
+        local n, err = file.write(self.stdin_fd, sent > 0 and data:sub(sent + 1) or data)
+        if n then
+            sent = sent + n
+        elseif err == EAGAIN then
+            if not self.stdin_w:wait(timeout) then
+                return nil, 'timeout', sent
+            end
+        else
+            return nil, err, sent
+        end
+    end
+
+    return sent
+end
+
 local exec_metatable = {
     __index = exec_methods,
     __gc = exec_methods.release
 }
 
+--[[
+    Executes a program: sys.exec(cmd, arg1, arg2, ..., opts)
+
+    opts is an optional Table as the last argument, see sys.exec in sys.c:
+    env: a table of the environment variables to set, false removes one
+    cwd: the working directory of the child
+    stdin: a boolean flag controls whether to write the stdin of the child by write_stdin
+    fds: a table maps the descriptors of the child to the ones of the parent
+--]]
 function M.exec(...)
-    local pid, stdout_fd, stderr_fd = sys.exec(...)
+    local pid, stdout_fd, stderr_fd, stdin_fd, pidfd = sys.exec(...)
     if not pid then
         return nil, stdout_fd
     end
@@ -52,12 +153,380 @@ function M.exec(...)
         __pid = pid,
         stdout_fd = stdout_fd,
         stderr_fd = stderr_fd,
+        stdin_fd = stdin_fd,
+        pidfd = pidfd,
+        child = sys.child(pid),
         child_w = eco.watcher(eco.CHILD, pid),
-        stdout_b = bufio.new(stdout_fd),
-        stderr_b = bufio.new(stderr_fd)
+        stdout_b = stdout_fd and bufio.new(stdout_fd),
+        stderr_b = stderr_fd and bufio.new(stderr_fd),
+        stdin_w = stdin_fd and eco.watcher(eco.IO, stdin_fd, eco.WRITE)
     }, exec_metatable)
 end
 
+local pipeline_methods = {}
+
+-- moves the data from fin to fout in the kernel until the end of fin
+local function splice_pump(fin, fout, rw, ww)
+    local readable = false
+
+    while true do
+        local n, err = file.splice(fin, fout)
+        if n == 0 then
+            return true
+        end
+
+        if n then
+            readable = false
+        elseif err ~= EAGAIN then
+            return nil, err
+        elseif readable then
+            -- fin is readable, so fout is full
+            if not ww:wait() then
+                return nil, 'canceled'
+            end
+            readable = false
+        else
+            if not rw:wait() then
+                return nil, 'canceled'
+            end
+            readable = true
+        end
+    end
+end
+
+--[[
+    Runs a pump between a pipe and a socket, own is the end of the pipe, which
+    is closed once the pump finishes. The pipeline waits for the pumps of output.
+--]]
+local function pipeline_pump(self, fin, fout, own, output)
+    local rw = eco.watcher(eco.IO, fin)
+    local ww = eco.watcher(eco.IO, fout, eco.WRITE)
+
+    self.watchers[#self.watchers + 1] = rw
+    self.watchers[#self.watchers + 1] = ww
+
+    if output then
+        self.wg:add(1)
+    end
+
+    eco.run(function()
+        local ok, err = splice_pump(fin, fout, rw, ww)
+        if not ok and err ~= 'canceled' then
+            self.pump_err = err
+        end
+
+        file.close(own)
+
+        if output then
+            self.wg:done()
+        end
+    end)
+end
+
+local function pipeline_open(t, output)
+    if output then
+        local flags = file.O_WRONLY | file.O_CREAT | file.O_CLOEXEC
+
+        flags = flags | (t.append and file.O_APPEND or file.O_TRUNC)
+
+        return file.open(t.file, flags, t.mode or 420) -- 0644
+    end
+
+    return file.open(t.file, file.O_RDONLY | file.O_CLOEXEC)
+end
+
+--[[
+    Resolves the stdout or stderr of a pipeline to the descriptor for the
+    children. The descriptors opened for the children are added to owned.
+--]]
+local function pipeline_output(self, target, stdfd, owned)
+    if target == 'inherit' then
+        return stdfd
+    end
+
+    if type(target) == 'number' then
+        return target
+    end
+
+    if type(target) == 'table' and target.file then
+        local fd, err = pipeline_open(target, true)
+        if fd then
+            owned[#owned + 1] = fd
+        end
+        return fd, err
+    end
+
+    local r, w = file.pipe()
+    if not r then
+        return nil, w
+    end
+
+    owned[#owned + 1] = w
+
+    if type(target) == 'table' and target.getfd then
+        pipeline_pump(self, r, target:getfd(), r, true)
+    else
+        local name = stdfd == 1 and 'stdout' or 'stderr'
+        self[name .. '_fd'] = r
+        self[name .. '_b'] = bufio.new(r)
+    end
+
+    return w
+end
+
+-- resolves the stdin of a pipeline, it returns the descriptor, or nil to inherit
+local function pipeline_input(self, source, owned)
+    if type(source) == 'number' then
+        return source
+    end
+
+    if type(source) ~= 'table' then
+        return nil
+    end
+
+    if source.file then
+        local fd, err = pipeline_open(source)
+        if fd then
+            owned[#owned + 1] = fd
+        end
+        return fd, err
+    end
+
+    local r, w = file.pipe()
+    if not r then
+        return nil, w
+    end
+
+    owned[#owned + 1] = r
+
+    pipeline_pump(self, source:getfd(), w, w)
+
+    return r
+end
+
+--[[
+    Waits for all the processes and the output pumps, the timeout is for the
+    whole pipeline. It returns a list of the status of each process, see exec.
+--]]
+function pipeline_methods:wait(timeout)
+    local deadline = time.now() + (timeout or 30.0)
+    local statuses = {}
+
+    for i, p in ipairs(self.stages) do
+        local pid, status = p:wait(math.max(deadline - time.now(), 0.001))
+        if not pid then
+            return nil, status
+        end
+
+        statuses[i] = status
+    end
+
+    local ok, err = self.wg:wait(math.max(deadline - time.now(), 0.001))
+    if not ok then
+        return nil, err
+    end
+
+    if self.pump_err then
+        return nil, self.pump_err
+    end
+
+    return statuses
+end
+
+function pipeline_methods:read_stdout(pattern, timeout)
+    if not self.stdout_b then
+        return nil, 'not piped'
+    end
+
+    return self.stdout_b:read(pattern, timeout)
+end
+
+function pipeline_methods:read_stderr(pattern, timeout)
+    if not self.stderr_b then
+        return nil, 'not piped'
+    end
+
+    return self.stderr_b:read(pattern, timeout)
+end
+
+-- sends a signal, defaults to SIGTERM, to all the processes
+function pipeline_methods:kill(sig)
+    for _, p in ipairs(self.stages) do
+        p:kill(sig)
+    end
+end
+
+function pipeline_methods:pids()
+    local pids = {}
+
+    for i, p in ipairs(self.stages) do
+        pids[i] = p:pid()
+    end
+
+    return pids
+end
+
+-- returns the metrics of each process, false for the ones exited, see exec:procstat
+function pipeline_methods:procstat(pss)
+    local stats = {}
+
+    for i, p in ipairs(self.stages) do
+        stats[i] = p:procstat(pss) or false
+    end
+
+    return stats
+end
+
+function pipeline_methods:release()
+    for _, p in ipairs(self.stages) do
+        p:release()
+    end
+
+    for _, w in ipairs(self.watchers) do
+        w:cancel()
+    end
+
+    if self.stdout_fd then
+        file.close(self.stdout_fd)
+        self.stdout_fd = nil
+    end
+
+    if self.stderr_fd then
+        file.close(self.stderr_fd)
+        self.stderr_fd = nil
+    end
+
+    self.stages = {}
+    self.watchers = {}
+end
+
+local pipeline_metatable = {
+    __index = pipeline_methods,
+    __gc = pipeline_methods.release
+}
+
+--[[
+    Runs a chain of processes, the stdout of each is connected to the stdin
+    of the next by a pipe, so the data flows in the kernel.
+
+    cmds is a list of the commands, each is a list of the program and its arguments:
+        sys.pipeline({{'cat', 'access.log'}, {'grep', 'GET'}, {'gzip'}}, {stdout = {file = 'get.gz'}})
+
+    opts is an optional Table that supports the following fields:
+    stdin: the stdin of the first process, which inherits the stdin of the parent by default
+           a string: the data is written to the process
+           a number: a descriptor
+           {file = path}: the file
+           a socket: the data received is spliced into the process
+    stdout: the stdout of the last process, defaults to a pipe read by read_stdout
+            'inherit': the stdout of the parent
+            a number: a descriptor
+            {file = path, append = bool, mode = 0644}: the file, truncated unless append is true
+            a socket: the output is spliced into the socket
+    stderr: the stderr of all the processes, supports the same values as stdout
+    env, cwd: see exec
+
+    The data only passes through Lua when read by read_stdout or read_stderr,
+    or written from a string. The data buffered by a socket isn't spliced.
+--]]
+function M.pipeline(cmds, opts)
+    opts = opts or {}
+
+    local self = setmetatable({
+        stages = {},
+        watchers = {},
+        wg = sync.waitgroup()
+    }, pipeline_metatable)
+
+    local owned = {}
+    local links = {}
+    local in_fd, out_fd, err_fd, err
+
+    local function fail(e)
+        for _, fd in ipairs(owned) do
+            file.close(fd)
+        end
+
+        self:kill(sys.SIGKILL)
+        self:release()
+
+        return nil, e
+    end
+
+    in_fd, err = pipeline_input(self, opts.stdin, owned)
+    if err then
+        return fail(err)
+    end
+
+    out_fd, err = pipeline_output(self, opts.stdout, 1, owned)
+    if not out_fd then
+        return fail(err)
+    end
+
+    err_fd, err = pipeline_output(self, opts.stderr, 2, owned)
+    if not err_fd then
+        return fail(err)
+    end
+
+    for i = 1, #cmds - 1 do
+        local r, w = file.pipe()
+        if not r then
+            return fail(w)
+        end
+
+        owned[#owned + 1] = r
+        owned[#owned + 1] = w
+
+        links[i] = { r = r, w = w }
+    end
+
+    for i, cmd in ipairs(cmds) do
+        local fds = { [1] = out_fd, [2] = err_fd }
+
+        if i > 1 then
+            fds[0] = links[i - 1].r
+        else
+            fds[0] = in_fd
+        end
+
+        if i < #cmds then
+            fds[1] = links[i].w
+        end
+
+        local args = { table.unpack(cmd) }
+
+        args[#args + 1] = {
+            fds = fds,
+            env = opts.env,
+            cwd = opts.cwd,
+            stdin = i == 1 and type(opts.stdin) == 'string'
+        }
+
+        local p, err = M.exec(table.unpack(args))
+        if not p then
+            return fail(err)
+        end
+
+        self.stages[i] = p
+    end
+
+    -- the children hold their ends now
+    for _, fd in ipairs(owned) do
+        file.close(fd)
+    end
+
+    if type(opts.stdin) == 'string' then
+        local p = self.stages[1]
+
+        eco.run(function()
+            p:write_stdin(opts.stdin)
+            p:close_stdin()
+        end)
+    end
+
+    return self
+end
+
 function M.signal(sig, cb, ...)
     local w = eco.watcher(eco.SIGNAL, sig)
 
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#include <zlib.h>
+
+#include "eco.h"
+
+#define ECO_ZLIB_INFLATE_MT "eco{zlib-inflate}"
+
+#define INFLATE_CHUNK_SIZE  16384
+
+struct eco_inflate {
+    z_stream strm;
+    bool raw_fallback;  /* retry as raw deflate if the zlib header is invalid */
+    bool started;
+    bool finished;
+    bool closed;
+};
+
+static int eco_inflate_init(struct eco_inflate *inf, int window_bits)
+{
+    memset(&inf->strm, 0, sizeof(z_stream));
+
+    return inflateInit2(&inf->strm, window_bits);
+}
+
+static int lua_inflate_update(lua_State *L)
+{
+    struct eco_inflate *inf = luaL_checkudata(L, 1, ECO_ZLIB_INFLATE_MT);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    z_stream *strm = &inf->strm;
+    luaL_Buffer b;
+    int ret;
+
+    if (inf->closed) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    luaL_buffinit(L, &b);
+
+    strm->next_in = (Bytef *)data;
+    strm->avail_in = len;
+
+    while (strm->avail_in > 0 && !inf->finished) {
+        strm->next_out = (Bytef *)luaL_prepbuffsize(&b, INFLATE_CHUNK_SIZE);
+        strm->avail_out = INFLATE_CHUNK_SIZE;
+
+        ret = inflate(strm, Z_NO_FLUSH);
+
+        if (ret == Z_DATA_ERROR && inf->raw_fallback && !inf->started) {
+            /* some servers send raw deflate data for "deflate" */
+            inflateEnd(strm);
+            inf->raw_fallback = false;
+
+            if (eco_inflate_init(inf, -MAX_WBITS) != Z_OK)
+                goto err;
+
+            strm->next_in = (Bytef *)data;
+            strm->avail_in = len;
+            continue;
+        }
+
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            goto err;
+
+        inf->started = true;
+
+        luaL_addsize(&b, INFLATE_CHUNK_SIZE - strm->avail_out);
+
+        if (ret == Z_STREAM_END) {
+            /* concatenated gzip members */
+            if (strm->avail_in > 0 && inflateReset(strm) == Z_OK)
+                continue;
+
+            inf->finished = true;
+        }
+
+        if (ret == Z_BUF_ERROR && strm->avail_out > 0)
+            break;
+    }
+
+    luaL_pushresult(&b);
+
+    return 1;
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, strm->msg ? strm->msg : zError(ret));
+    return 2;
+}
+
+static int lua_inflate_finished(lua_State *L)
+{
+    struct eco_inflate *inf = luaL_checkudata(L, 1, ECO_ZLIB_INFLATE_MT);
+
+    lua_pushboolean(L, inf->finished);
+
+    return 1;
+}
+
+static int lua_inflate_close(lua_State *L)
+{
+    struct eco_inflate *inf = luaL_checkudata(L, 1, ECO_ZLIB_INFLATE_MT);
+
+    if (inf->closed)
+        return 0;
+
+    inflateEnd(&inf->strm);
+    inf->closed = true;
+
+    return 0;
+}
+
+static const struct luaL_Reg inflate_methods[] =  {
+    {"update", lua_inflate_update},
+    {"finished", lua_inflate_finished},
+    {"close", lua_inflate_close},
+    {"__gc", lua_inflate_close},
+    {NULL, NULL}
+};
+
+/*
+  Creates a streaming decompressor.
+  The format can be 'gzip', 'deflate' (zlib format, or raw deflate data) or
+  nil to detect gzip and zlib format automatically.
+*/
+static int lua_inflate(lua_State *L)
+{
+    const char *format = luaL_optstring(L, 1, "auto");
+    struct eco_inflate *inf;
+    int window_bits;
+
+    if (!strcmp(format, "auto"))
+        window_bits = MAX_WBITS + 32;
+    else if (!strcmp(format, "gzip"))
+        window_bits = MAX_WBITS + 16;
+    else if (!strcmp(format, "deflate"))
+        window_bits = MAX_WBITS;
+    else
+        return luaL_argerror(L, 1, "must be 'gzip' or 'deflate'");
+
+    inf = lua_newuserdata(L, sizeof(struct eco_inflate));
+    memset(inf, 0, sizeof(struct eco_inflate));
+
+    if (eco_inflate_init(inf, window_bits) != Z_OK) {
+        inf->closed = true;
+        lua_pushnil(L);
+        lua_pushstring(L, inf->strm.msg ? inf->strm.msg : "init inflate fail");
+        return 2;
+    }
+
+    inf->raw_fallback = window_bits == MAX_WBITS;
+
+    luaL_setmetatable(L, ECO_ZLIB_INFLATE_MT);
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"inflate", lua_inflate},
+    {NULL, NULL}
+};
+
+int luaopen_eco_zlib(lua_State *L)
+{
+    eco_new_metatable(L, ECO_ZLIB_INFLATE_MT, inflate_methods);
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+
+    lua_pushstring(L, zlibVersion());
+    lua_setfield(L, -2, "VERSION");
+
+    return 1;
+}